@@ -1,16 +1,51 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <string.h>
 #include <stdbool.h>
 #include <time.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-struct timespec start, stop;
-double accum;
+struct timespec start;
 
-pthread_mutex_t station_mutex, track_mutex;
-pthread_cond_t load_cond, cross_cond;
+pthread_mutex_t load_mutex;
+pthread_cond_t load_cond;
+
+// Length of one unit of loading or crossing time in the input file, in nanoseconds
+#define TICK_NS 100000000L
+
+// Number of trains sent back to back in one direction after which a train waiting in the other direction gets the track
+#define STARVATION_LIMIT 4
+
+// Number of ticks the timer wheel covers in one turn; a timer further ahead waits in its slot for later turns
+#define WHEEL_SLOTS 1024
+
+// Number of records each thread's event log ring holds; a thread that fills its ring waits for the log writer to catch up
+#define LOG_RING_SIZE 8192
+
+// Size of the buffer the log writer formats records into before writing them out in one go
+#define LOG_BUFFER_SIZE 65536
+
+// Every power of two a histogram covers is split into this many buckets, so a recorded value is off by at most 1/16 of itself
+#define HISTOGRAM_SUB_BUCKETS 16
+#define HISTOGRAM_BUCKETS (64 * HISTOGRAM_SUB_BUCKETS)
+
+// Number of longest waiting trains the metrics summary lists
+#define TOP_WAITS 5
+
+// What a train's timer does when it expires: queue the train at its station through the worker pool, or free the crossing slot it holds
+enum task_kind_t
+{
+    TASK_READY,
+    TASK_OFF
+};
 
 // Struct containing train information
 typedef struct train_t
@@ -20,264 +55,1603 @@ typedef struct train_t
     char direction;
     int loading_time;
     int crossing_time;
-    bool ready;
+    // Tick at which the dispatcher put the train on a track, the track it took, and the monotonic time it chose the train at
+    long on_tick;
+    int track;
+    long long dispatch_ns;
+    // A train waits for at most one step at a time, so it carries its own timer wheel and task queue links, and its link in the ready queue to the dispatcher
+    enum task_kind_t task;
+    long timer_tick;
+    struct train_t *timer_next;
+    struct train_t *ready_next;
+    // Nanoseconds since the start at which the train was READY, and how long it then waited to go ON, for the metrics
+    long long ready_ns;
+    long long wait_ns;
 } train_t;
 
-// Struct containing node information for a linked list based priority queue
-typedef struct node_t
+// Binary min-heap of the trains waiting at a station, the train that leaves next at the root. The slots come from one block sized to the number of trains, so pushing and popping never allocate
+typedef struct station_t
 {
-    int priority;
-    train_t *train_data;
-    struct node_t *next;
-} node_t;
+    train_t **trains;
+    int total_trains;
+} station_t;
 
 // Priority queues for the east and west stations
-node_t *station_east;
-node_t *station_west;
+station_t station_east;
+station_t station_west;
+
+// Decisions the dispatcher has made so far, which the next decision depends on
+typedef struct dispatch_t
+{
+    // Direction of the last train sent, or 0 before the first one
+    char last;
+    // Number of trains sent back to back in that direction
+    int streak;
+} dispatch_t;
+
+// Trains that have finished loading, handed from the workers to the dispatcher without a lock: a worker pushes the train onto the stack for its direction, and the dispatcher takes a whole stack at once and orders the trains in its own station heaps
+_Atomic(train_t *) ready_east;
+_Atomic(train_t *) ready_west;
+
+// Trains that have finished loading, counted once they are on a ready stack. Workers only take the load mutex to wake the dispatcher when it is waiting for this count
+atomic_int total_loaded;
+atomic_bool dispatcher_waiting;
+
+// One of the parallel crossings. Busy is set while a train is on the track, under the track's own mutex; the dispatcher fills the track and waits on its cond for the timer wheel to empty it
+typedef struct track_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool busy;
+    // Train on the track and the tick it leaves at, kept by the dispatcher alone
+    train_t *train;
+    long off_tick;
+    // Ticks trains have spent crossing the track, for the metrics
+    atomic_llong busy_ticks;
+} track_t;
+
+// Tracks trains cross on, set with -t; with a single track the output names it the main track
+track_t *tracks;
+int total_tracks = 1;
+
+// Suppress the schedule output, for the throughput benchmark
+bool quiet;
+
+// States of a train the event log records
+enum state_t
+{
+    STATE_READY,
+    STATE_ON,
+    STATE_OFF
+};
+
+// A compact binary event record, stamped in nanoseconds since the simulation started; the writer looks up everything else about the train when it formats the record
+typedef struct record_t
+{
+    long long ns;
+    int train_number;
+    enum state_t state;
+} record_t;
+
+// Ring of records a single thread appends to and the log writer drains
+typedef struct ring_t
+{
+    record_t records[LOG_RING_SIZE];
+    atomic_llong head;
+    atomic_llong tail;
+    // A time no later than the stamp of the record the owner is appending, or LLONG_MAX while it is not appending one; records stamped after it wait for that record, so the output stays in time order
+    atomic_llong pending_ns;
+    struct ring_t *next;
+} ring_t;
 
-// Push the appropriate train to the front of the queue based on it's priority
-void push(node_t **head, train_t *train_data)
+// Formats the event log writes the schedule in, chosen with -f
+enum log_format_t
 {
-    node_t *front = *head;
+    FORMAT_TEXT,
+    FORMAT_CSV,
+    FORMAT_JSON
+};
 
-    // Allocate memory for a new node to be pushed into the linked list
-    node_t *tmp = (node_t *)malloc(sizeof(node_t));
-    tmp->train_data = train_data;
-    tmp->priority = train_data->priority;
-    tmp->next = NULL;
+// Event log: every thread that logs gets its own ring, and a background writer merges the rings in time order, formats the records and writes them out in large batches
+typedef struct log_t
+{
+    _Atomic(ring_t *) rings;
+    atomic_bool stop;
+    // Records carry simulated times in virtual time, and a single thread logs, so the writer need not hold any back
+    bool virtual_time;
+    enum log_format_t format;
+    train_t *trains;
+    long long start_ns;
+    pthread_t writer;
+} log_t;
+
+log_t event_log;
+_Thread_local ring_t *own_ring;
+
+// Timers of trains that are loading or crossing, hashed by tick into the slots of a wheel that a single thread turns once per tick
+typedef struct wheel_t
+{
+    train_t *slots[WHEEL_SLOTS];
+    // Every tick up to and including this one has fired
+    long fired;
+    bool stop;
+    pthread_mutex_t mutex;
+} wheel_t;
+
+// Fixed set of worker threads running train steps from a shared ring of trains
+typedef struct pool_t
+{
+    train_t **ring;
+    int capacity;
+    int head;
+    int total;
+    bool stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    int total_threads;
+} pool_t;
+
+wheel_t wheel;
+pool_t pool;
 
-    if (*head == NULL)
+// Latency from the dispatcher choosing a train to the train being ON the main track, reported with -l
+typedef struct latency_t
+{
+    long long total_ns;
+    long long max_ns;
+    int count;
+} latency_t;
+
+latency_t on_latency;
+bool report_latency;
+
+// Log-linear histogram of non-negative values in fixed-size atomic buckets, so recording is a few relaxed atomic adds and never takes a lock
+typedef struct histogram_t
+{
+    atomic_llong counts[HISTOGRAM_BUCKETS];
+    atomic_llong total;
+    atomic_llong sum;
+    atomic_llong max;
+} histogram_t;
+
+// How well the dispatch policy did, collected on every run and summarized at exit with -m
+typedef struct metrics_t
+{
+    // Time from READY to ON, in microseconds, so the sum of a million trains waiting hours each still fits
+    histogram_t wait;
+    // Trains waiting at both stations each time the dispatcher chose one
+    histogram_t depth;
+    atomic_int max_depth_east;
+    atomic_int max_depth_west;
+    // Longest run of trains sent back to back in one direction, and how often the starvation rule chose the direction
+    atomic_int longest_streak;
+    atomic_int longest_streak_direction;
+    atomic_llong starvation_switches;
+    // Tick at which the last train leaves its track
+    atomic_llong end_tick;
+} metrics_t;
+
+metrics_t metrics;
+bool report_metrics;
+
+// Return true if train a leaves its station before train b: high priority trains go first, then trains leave in the order they finished loading, and if the loading times are the same, in the order they appear in the input file
+bool leaves_before(const train_t *a, const train_t *b)
+{
+    if (a->priority != b->priority)
+        return a->priority > b->priority;
+    if (a->loading_time != b->loading_time)
+        return a->loading_time < b->loading_time;
+    return a->train_number < b->train_number;
+}
+
+// Push a train onto a station, sifting it up to its place
+void push(station_t *station, train_t *train_data)
+{
+    int i = station->total_trains++;
+    while (i > 0 && leaves_before(train_data, station->trains[(i - 1) / 2]))
     {
-        *head = tmp;
-        return;
+        station->trains[i] = station->trains[(i - 1) / 2];
+        i = (i - 1) / 2;
     }
+    station->trains[i] = train_data;
+}
 
-    // If the loading times are the same for two trains, push the train that appears before in the input file to the front of the priority queue
-    if (tmp->train_data->loading_time == front->train_data->loading_time && tmp->train_data->train_number < front->train_data->train_number)
+// Remove and return the train that leaves a station next, sifting the last train down into the hole
+train_t *pop(station_t *station)
+{
+    train_t *first = station->trains[0];
+    train_t *last = station->trains[--station->total_trains];
+    int i = 0;
+    while (true)
     {
-        // Set the new node to be the head of the linked list
-        tmp->next = front;
-        front = tmp;
+        int child = 2 * i + 1;
+        if (child >= station->total_trains)
+            break;
+        if (child + 1 < station->total_trains && leaves_before(station->trains[child + 1], station->trains[child]))
+            child++;
+        if (leaves_before(last, station->trains[child]) == true)
+            break;
+        station->trains[i] = station->trains[child];
+        i = child;
     }
+    station->trains[i] = last;
+    return first;
+}
+
+// Hand a train to the dispatcher by pushing it onto a ready stack; a failed compare and swap means another worker pushed first, so retry on the new top
+void ready_push(_Atomic(train_t *) *ready, train_t *train_data)
+{
+    train_t *top = atomic_load_explicit(ready, memory_order_relaxed);
+    do
+        train_data->ready_next = top;
+    while (atomic_compare_exchange_weak_explicit(ready, &top, train_data, memory_order_release, memory_order_relaxed) == false);
+}
+
+// If the priority queue is empty return true, if not return false
+bool is_empty(station_t *station)
+{
+    return (station->total_trains == 0 ? true : false);
+}
+
+// Return the monotonic clock in nanoseconds
+long long now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Record how long a train took from being chosen to being ON the main track; only the dispatcher records, so no lock is needed
+void record_on_latency(train_t *curr_train)
+{
+    long long latency = now_ns() - curr_train->dispatch_ns;
+    on_latency.total_ns += latency;
+    on_latency.max_ns = latency > on_latency.max_ns ? latency : on_latency.max_ns;
+    on_latency.count++;
+}
+
+// Return the histogram bucket a value falls in: values below 16 get a bucket each, and every power of two above is split into 16 buckets
+int histogram_index(long long value)
+{
+    if (value < HISTOGRAM_SUB_BUCKETS)
+        return value < 0 ? 0 : value;
+    int shift = 63 - __builtin_clzll(value) - 4;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (value >> shift) % HISTOGRAM_SUB_BUCKETS;
+}
+
+// Return the smallest value that falls in a histogram bucket
+long long histogram_floor(int index)
+{
+    if (index < HISTOGRAM_SUB_BUCKETS)
+        return index;
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (long long)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+}
+
+// Raise an atomic maximum to value if it is larger
+void atomic_raise(atomic_llong *max, long long value)
+{
+    long long seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed) == false)
+        ;
+}
+
+// Same as atomic_raise, for an int
+void atomic_raise_int(atomic_int *max, int value)
+{
+    int seen = atomic_load_explicit(max, memory_order_relaxed);
+    while (value > seen && atomic_compare_exchange_weak_explicit(max, &seen, value, memory_order_relaxed, memory_order_relaxed) == false)
+        ;
+}
+
+// Count a value in a histogram
+void histogram_record(histogram_t *histogram, long long value)
+{
+    atomic_fetch_add_explicit(&histogram->counts[histogram_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    atomic_raise(&histogram->max, value);
+}
+
+// Return the value below which the given fraction of the recorded values fall, to within the width of its bucket
+long long histogram_percentile(histogram_t *histogram, double fraction)
+{
+    long long total = atomic_load(&histogram->total);
+    long long rank = (long long)(fraction * total + 0.999999);
+    long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= rank && seen > 0)
+        {
+            long long ceiling = histogram_floor(i + 1) - 1;
+            long long max = atomic_load(&histogram->max);
+            return ceiling < max ? ceiling : max;
+        }
+    }
+    return 0;
+}
+
+// Record that a train went ON its track at on_ns, having waited since it was READY, and the crossing it holds the track for
+void metrics_on(train_t *curr_train, long long on_ns)
+{
+    curr_train->wait_ns = on_ns - curr_train->ready_ns;
+    histogram_record(&metrics.wait, curr_train->wait_ns / 1000);
+    atomic_fetch_add_explicit(&tracks[curr_train->track].busy_ticks, curr_train->crossing_time, memory_order_relaxed);
+    atomic_raise(&metrics.end_tick, curr_train->on_tick + curr_train->crossing_time);
+}
+
+// Print a duration in nanoseconds with a unit that suits it
+void print_duration(const char *label, long long ns)
+{
+    if (ns >= 1000000000LL)
+        fprintf(stderr, "%s %.2f s", label, ns / 1e9);
+    else if (ns >= 1000000)
+        fprintf(stderr, "%s %.2f ms", label, ns / 1e6);
     else
+        fprintf(stderr, "%s %.1f us", label, ns / 1e3);
+}
+
+// Summarize the metrics on stderr once every train is off its track
+void print_metrics(train_t *train, int total_trains)
+{
+    long long end_tick = atomic_load(&metrics.end_tick);
+    fprintf(stderr, "Metrics: %d trains on %d track%s over %.1f s\n", total_trains, total_tracks, total_tracks == 1 ? "" : "s", end_tick / 10.0);
+    if (atomic_load(&metrics.wait.total) == 0)
+        return;
+
+    fprintf(stderr, "  Wait from READY to ON:");
+    print_duration(" mean", atomic_load(&metrics.wait.sum) / atomic_load(&metrics.wait.total) * 1000);
+    print_duration(", p50", histogram_percentile(&metrics.wait, 0.50) * 1000);
+    print_duration(", p90", histogram_percentile(&metrics.wait, 0.90) * 1000);
+    print_duration(", p99", histogram_percentile(&metrics.wait, 0.99) * 1000);
+    print_duration(", max", atomic_load(&metrics.wait.max) * 1000);
+    fprintf(stderr, "\n");
+
+    long long busy = 0;
+    for (int i = 0; i < total_tracks; i++)
     {
-        // If the loading times are not the same, continue until a train is found that has the same loading time, but appears before in the input file
-        while (tmp->train_data->loading_time == front->next->train_data->loading_time && tmp->train_data->train_number < front->next->train_data->train_number)
-            // Set the node to be the head of the linked list
-            front = front->next;
+        long long track_busy = atomic_load(&tracks[i].busy_ticks);
+        busy += track_busy;
+        if (total_tracks > 1)
+            fprintf(stderr, "  Track %d busy %.1f%%\n", i, end_tick > 0 ? 100.0 * track_busy / end_tick : 0.0);
+    }
+    fprintf(stderr, "  Track utilization %.1f%%\n", end_tick > 0 ? 100.0 * busy / end_tick / total_tracks : 0.0);
+
+    fprintf(stderr, "  Longest streak %d trains going %s, starvation rule applied %lld times\n", atomic_load(&metrics.longest_streak), atomic_load(&metrics.longest_streak_direction) == 'E' ? "East" : "West", atomic_load(&metrics.starvation_switches));
+    fprintf(stderr, "  Trains waiting at each decision: mean %.1f, p50 %lld, p99 %lld, max %lld (East %d, West %d)\n", (double)atomic_load(&metrics.depth.sum) / atomic_load(&metrics.depth.total), histogram_percentile(&metrics.depth, 0.50), histogram_percentile(&metrics.depth, 0.99), atomic_load(&metrics.depth.max), atomic_load(&metrics.max_depth_east), atomic_load(&metrics.max_depth_west));
 
-        // If the above conditions are not meant, have the node come after the head of the linked list
-        tmp->next = front->next;
-        front->next = tmp;
+    // Find the longest waits by keeping the top few in order, one pass over the trains
+    train_t *longest[TOP_WAITS] = {NULL};
+    for (int i = 0; i < total_trains; i++)
+    {
+        train_t *curr_train = &train[i];
+        for (int j = 0; j < TOP_WAITS && curr_train != NULL; j++)
+            if (longest[j] == NULL || curr_train->wait_ns > longest[j]->wait_ns)
+            {
+                train_t *displaced = longest[j];
+                longest[j] = curr_train;
+                curr_train = displaced;
+            }
+    }
+    fprintf(stderr, "  Longest waits:");
+    for (int j = 0; j < TOP_WAITS && longest[j] != NULL; j++)
+    {
+        fprintf(stderr, "%s train %d", j == 0 ? "" : ",", longest[j]->train_number);
+        print_duration("", longest[j]->wait_ns);
     }
+    fprintf(stderr, "\n");
 }
 
-// Free memory associated with the desired node in the priority queue
-void pop(node_t **head)
+// Sleep until the given number of ticks after the simulation started, so delays never accumulate from one sleep to the next
+void sleep_until(long tick)
 {
-    // Move the head pointer
-    node_t *tmp = *head;
-    *head = (*head)->next;
-    // Free the memory associated with the node
-    free(tmp);
+    struct timespec deadline = start;
+    long long nanoseconds = deadline.tv_nsec + (long long)tick * TICK_NS;
+    deadline.tv_sec += nanoseconds / 1000000000L;
+    deadline.tv_nsec = nanoseconds % 1000000000L;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR)
+        ;
 }
 
-// If the priority queue is empty return true, if not return false
-bool is_empty(node_t **head)
+// Return the calling thread's log ring, creating it and adding it to the writer's list on the thread's first event
+ring_t *log_ring(void)
 {
-    // If the head of the linked list is empty (NULL) return true, otherwise return false
-    return (*head == NULL ? true : false);
+    if (own_ring == NULL)
+    {
+        own_ring = calloc(1, sizeof(*own_ring));
+        atomic_init(&own_ring->pending_ns, LLONG_MAX);
+        ring_t *first = atomic_load(&event_log.rings);
+        do
+            own_ring->next = first;
+        while (atomic_compare_exchange_weak(&event_log.rings, &first, own_ring) == false);
+    }
+    return own_ring;
 }
 
-// Print the state of the train depending on whether the state is READY, ON or OFF
-void print_output(train_t *curr_train, char *print_flag)
+// Append a record to a ring, waiting for the writer while the ring is full
+void log_append(ring_t *ring, record_t record)
 {
-    // Adapted from the tutorial slides
-    if (clock_gettime(CLOCK_REALTIME, &stop) == -1)
-        perror("Error at clock_gettime with stop");
+    long long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == LOG_RING_SIZE)
+        sched_yield();
+    ring->records[head % LOG_RING_SIZE] = record;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    accum = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1000000000.0;
-    int minutes = (int)accum / 60;
-    int hours = (int)accum / 3600;
+// Log that a train reached a state now. The ring announces a lower bound on the stamp before the clock is read for it, so the writer never writes a later record ahead of this one
+void log_event(train_t *curr_train, enum state_t state)
+{
+    if (quiet == true)
+        return;
+    ring_t *ring = log_ring();
+    atomic_store(&ring->pending_ns, now_ns() - event_log.start_ns);
+    record_t record = {now_ns() - event_log.start_ns, curr_train->train_number, state};
+    log_append(ring, record);
+    atomic_store(&ring->pending_ns, LLONG_MAX);
+}
 
-    // Set the direction string by checking the direction of the current train being interacted with
+// Log that a train reached a state at the given tick of virtual time
+void log_event_at(train_t *curr_train, enum state_t state, long tick)
+{
+    if (quiet == true)
+        return;
+    record_t record = {(long long)tick * TICK_NS, curr_train->train_number, state};
+    log_append(log_ring(), record);
+}
+
+// Write a number right-aligned in at least width characters, padded with pad, returning its length
+int put_number(char *out, long long value, int width, char pad)
+{
+    char digits[24];
+    int total = 0;
+    unsigned long long magnitude = value < 0 ? -(unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[total++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude > 0);
+    if (value < 0)
+        digits[total++] = '-';
+    int length = 0;
+    for (; length < width - total; length++)
+        out[length] = pad;
+    while (total > 0)
+        out[length++] = digits[--total];
+    return length;
+}
+
+// Copy a string without its terminator, returning its length
+int put_string(char *out, const char *string)
+{
+    int length = strlen(string);
+    memcpy(out, string, length);
+    return length;
+}
+
+// Format a record as a line of the chosen format, returning its length. The writer formats every line, so numbers are written by hand rather than through printf; text lines read as hours, minutes and seconds rounded to the tenth
+int format_record(char *line, const record_t *record)
+{
+    static const char *states[] = {"READY", "ON", "OFF"};
+    train_t *curr_train = &event_log.trains[record->train_number];
     char *direction = curr_train->direction == 'E' || curr_train->direction == 'e' ? "East" : "West";
+    int length = 0;
+
+    if (event_log.format == FORMAT_CSV)
+    {
+        length += put_number(line + length, record->ns, 0, ' ');
+        line[length++] = ',';
+        length += put_number(line + length, curr_train->train_number, 0, ' ');
+        line[length++] = ',';
+        length += put_string(line + length, states[record->state]);
+        line[length++] = ',';
+        length += put_string(line + length, direction);
+        line[length++] = ',';
+        if (record->state != STATE_READY)
+            length += put_number(line + length, curr_train->track, 0, ' ');
+        line[length++] = '\n';
+        return length;
+    }
+    if (event_log.format == FORMAT_JSON)
+    {
+        length += put_string(line + length, "{\"ns\":");
+        length += put_number(line + length, record->ns, 0, ' ');
+        length += put_string(line + length, ",\"train\":");
+        length += put_number(line + length, curr_train->train_number, 0, ' ');
+        length += put_string(line + length, ",\"state\":\"");
+        length += put_string(line + length, states[record->state]);
+        length += put_string(line + length, "\",\"direction\":\"");
+        length += put_string(line + length, direction);
+        line[length++] = '"';
+        if (record->state != STATE_READY)
+        {
+            length += put_string(line + length, ",\"track\":");
+            length += put_number(line + length, curr_train->track, 0, ' ');
+        }
+        length += put_string(line + length, "}\n");
+        return length;
+    }
+
+    // Print the state of the train depending on whether the state is READY, ON or OFF
+    long long tenths = (record->ns + TICK_NS / 2) / TICK_NS;
+    length += put_number(line + length, tenths / 36000, 2, '0');
+    line[length++] = ':';
+    length += put_number(line + length, tenths / 600 % 60, 2, '0');
+    line[length++] = ':';
+    length += put_number(line + length, tenths % 600 / 10, 2, '0');
+    line[length++] = '.';
+    length += put_number(line + length, tenths % 10, 1, '0');
+    length += put_string(line + length, " Train ");
+    length += put_number(line + length, curr_train->train_number, 2, ' ');
+    if (record->state == STATE_READY)
+        length += put_string(line + length, " is ready to go ");
+    else if (record->state == STATE_ON && total_tracks == 1)
+        length += put_string(line + length, " is ON on the main track going ");
+    else if (record->state == STATE_ON)
+    {
+        length += put_string(line + length, " is ON on track ");
+        length += put_number(line + length, curr_train->track, 0, ' ');
+        length += put_string(line + length, " going ");
+    }
+    else if (total_tracks == 1)
+        length += put_string(line + length, " is OFF the main track after going ");
+    else
+    {
+        length += put_string(line + length, " is OFF track ");
+        length += put_number(line + length, curr_train->track, 0, ' ');
+        length += put_string(line + length, " after going ");
+    }
+    length += put_string(line + length, direction);
+    line[length++] = '\n';
+    return length;
+}
+
+// A record taken from a ring, numbered in the order it was taken so records stamped alike keep their ring's order
+typedef struct batched_t
+{
+    record_t record;
+    long long order;
+} batched_t;
+
+int compare_batched(const void *a, const void *b)
+{
+    const batched_t *x = a, *y = b;
+    if (x->record.ns != y->record.ns)
+        return x->record.ns < y->record.ns ? -1 : 1;
+    return x->order < y->order ? -1 : x->order > y->order;
+}
+
+// Drain every ring up to the time no record can still arrive before, sort what was taken by stamp, and write it out in large blocks, until the log is stopped and empty
+void *log_writer(void *arg)
+{
+    int capacity = LOG_RING_SIZE;
+    batched_t *batch = malloc(capacity * sizeof(*batch));
+    char *buffer = malloc(LOG_BUFFER_SIZE);
+    long long order = 0;
+    if (event_log.format == FORMAT_CSV)
+        printf("ns,train,state,direction,track\n");
+    while (true)
+    {
+        // Every thread has logged its last event once the log is stopped, so the final pass takes everything
+        bool stopping = atomic_load(&event_log.stop);
+        long long cutoff = stopping == true || event_log.virtual_time == true ? LLONG_MAX : now_ns() - event_log.start_ns;
+        ring_t *first = atomic_load(&event_log.rings);
+        for (ring_t *ring = first; ring != NULL; ring = ring->next)
+        {
+            long long pending = atomic_load(&ring->pending_ns);
+            cutoff = pending < cutoff ? pending : cutoff;
+        }
+
+        int total_batched = 0;
+        for (ring_t *ring = first; ring != NULL; ring = ring->next)
+        {
+            long long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            long long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            for (; tail < head && ring->records[tail % LOG_RING_SIZE].ns <= cutoff; tail++)
+            {
+                if (total_batched == capacity)
+                {
+                    capacity *= 2;
+                    batch = realloc(batch, capacity * sizeof(*batch));
+                }
+                batch[total_batched].record = ring->records[tail % LOG_RING_SIZE];
+                batch[total_batched++].order = order++;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+        qsort(batch, total_batched, sizeof(*batch), compare_batched);
+
+        int length = 0;
+        for (int i = 0; i < total_batched; i++)
+        {
+            if (length > LOG_BUFFER_SIZE - 256)
+            {
+                fwrite(buffer, 1, length, stdout);
+                length = 0;
+            }
+            length += format_record(buffer + length, &batch[i].record);
+        }
+        fwrite(buffer, 1, length, stdout);
+        fflush(stdout);
+
+        if (stopping == true)
+            break;
+        // Let records pile up for a millisecond when there was little to write, so they go out in large batches
+        if (total_batched < LOG_RING_SIZE / 2)
+        {
+            struct timespec pause = {0, 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    free(buffer);
+    free(batch);
+    return NULL;
+}
+
+// Start the background log writer for the given trains; returns -1 if the writer cannot start, since without it every ring would fill and its producers wait forever
+int log_start(train_t *train, bool virtual_time, enum log_format_t format)
+{
+    event_log.trains = train;
+    event_log.virtual_time = virtual_time;
+    event_log.format = format;
+    event_log.start_ns = start.tv_sec * 1000000000LL + start.tv_nsec;
+    if (pthread_create(&event_log.writer, NULL, &log_writer, NULL) != 0)
+    {
+        perror("Error at event_log.writer");
+        return -1;
+    }
+    return 0;
+}
+
+// Write out every record left once the last event is logged, and free the rings
+void log_stop(void)
+{
+    atomic_store(&event_log.stop, true);
+    pthread_join(event_log.writer, NULL);
+    ring_t *ring = atomic_exchange(&event_log.rings, NULL);
+    while (ring != NULL)
+    {
+        ring_t *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+}
+
+// Choose the station the next train leaves from, 'E' or 'W'; at least one station must hold a train
+char pick_station(dispatch_t *dispatch)
+{
+    if (is_empty(&station_west) == true)
+        return 'E';
+    if (is_empty(&station_east) == true)
+        return 'W';
+
+    // Once one direction has sent enough trains back to back, a train waiting in the other direction goes next
+    if (dispatch->streak >= STARVATION_LIMIT)
+        return dispatch->last == 'E' ? 'W' : 'E';
+    // Otherwise a high priority train goes before a low priority one
+    if (station_east.trains[0]->priority != station_west.trains[0]->priority)
+        return station_east.trains[0]->priority > station_west.trains[0]->priority ? 'E' : 'W';
+    // Between trains of the same priority, the direction opposite to the last train sent goes next, starting with East
+    return dispatch->last == 'E' ? 'W' : 'E';
+}
+
+// Return the lowest numbered free track, or -1 if every track is busy
+int free_track(void)
+{
+    for (int i = 0; i < total_tracks; i++)
+        if (tracks[i].train == NULL)
+            return i;
+    return -1;
+}
+
+// Pop the next train from the station pick_station chose, and record the decision
+train_t *dispatch_next(dispatch_t *dispatch)
+{
+    // Sample how many trains wait at each station, and whether the starvation rule is what decides
+    int depth_east = station_east.total_trains, depth_west = station_west.total_trains;
+    histogram_record(&metrics.depth, depth_east + depth_west);
+    atomic_raise_int(&metrics.max_depth_east, depth_east);
+    atomic_raise_int(&metrics.max_depth_west, depth_west);
+    if (depth_east > 0 && depth_west > 0 && dispatch->streak >= STARVATION_LIMIT)
+        atomic_fetch_add_explicit(&metrics.starvation_switches, 1, memory_order_relaxed);
+
+    char direction = pick_station(dispatch);
+    train_t *curr_train = pop(direction == 'E' ? &station_east : &station_west);
+
+    dispatch->streak = dispatch->last == direction ? dispatch->streak + 1 : 1;
+    dispatch->last = direction;
+    if (dispatch->streak > atomic_load_explicit(&metrics.longest_streak, memory_order_relaxed))
+    {
+        atomic_store_explicit(&metrics.longest_streak, dispatch->streak, memory_order_relaxed);
+        atomic_store_explicit(&metrics.longest_streak_direction, direction, memory_order_relaxed);
+    }
+    return curr_train;
+}
+
+// Queue a step of a train for the worker pool
+void pool_submit(train_t *curr_train, enum task_kind_t task)
+{
+    pthread_mutex_lock(&pool.mutex);
+    curr_train->task = task;
+    pool.ring[(pool.head + pool.total++) % pool.capacity] = curr_train;
+    pthread_cond_signal(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+}
+
+// Act on a train's expired timer: a train that finished loading goes to the pool, while a train whose crossing time is up frees its track straight away, waking only the dispatcher
+void timer_expire(train_t *curr_train, enum task_kind_t task)
+{
+    if (task == TASK_READY)
+    {
+        pool_submit(curr_train, task);
+        return;
+    }
+    track_t *track = &tracks[curr_train->track];
+    pthread_mutex_lock(&track->mutex);
+    track->busy = false;
+    pthread_cond_signal(&track->cond);
+    pthread_mutex_unlock(&track->mutex);
+}
+
+// Arm a train's timer to act once the clock reaches tick; a tick that has already fired acts right away
+void wheel_schedule(train_t *curr_train, long tick, enum task_kind_t task)
+{
+    pthread_mutex_lock(&wheel.mutex);
+    if (tick <= wheel.fired)
+    {
+        pthread_mutex_unlock(&wheel.mutex);
+        timer_expire(curr_train, task);
+        return;
+    }
+    curr_train->task = task;
+    curr_train->timer_tick = tick;
+    curr_train->timer_next = wheel.slots[tick % WHEEL_SLOTS];
+    wheel.slots[tick % WHEEL_SLOTS] = curr_train;
+    pthread_mutex_unlock(&wheel.mutex);
+}
+
+// Turn the wheel one slot per tick, acting on every timer that expires
+void *wheel_turn(void *arg)
+{
+    for (long tick = 1;; tick++)
+    {
+        sleep_until(tick);
+
+        // Take the timers of this tick out of its slot, leaving those due in a later turn of the wheel
+        pthread_mutex_lock(&wheel.mutex);
+        if (wheel.stop == true)
+        {
+            pthread_mutex_unlock(&wheel.mutex);
+            return NULL;
+        }
+        train_t *expired = NULL;
+        for (train_t **link = &wheel.slots[tick % WHEEL_SLOTS]; *link != NULL;)
+        {
+            train_t *curr_train = *link;
+            if (curr_train->timer_tick != tick)
+            {
+                link = &curr_train->timer_next;
+                continue;
+            }
+            *link = curr_train->timer_next;
+            curr_train->timer_next = expired;
+            expired = curr_train;
+        }
+        wheel.fired = tick;
+        pthread_mutex_unlock(&wheel.mutex);
 
-    // Compare the print flag to the READY, ON and OFF state, and print the appropriate output
-    if (strcmp(print_flag, "READY") == 0)
-        printf("%02d:%02d:%04.1f Train %2d is ready to go %4s\n", hours, minutes, accum, curr_train->train_number, direction);
-    else if (strcmp(print_flag, "ON") == 0)
-        printf("%02d:%02d:%04.1f Train %2d is ON on the main track going %4s\n", hours, minutes, accum, curr_train->train_number, direction);
-    else if (strcmp(print_flag, "OFF") == 0)
-        printf("%02d:%02d:%04.1f Train %2d is OFF the main track after going %4s\n", hours, minutes, accum, curr_train->train_number, direction);
+        while (expired != NULL)
+        {
+            train_t *curr_train = expired;
+            expired = curr_train->timer_next;
+            timer_expire(curr_train, curr_train->task);
+        }
+    }
+}
+
+// Finish loading a train: print that it is ready and queue it at its station
+void run_task(train_t *curr_train)
+{
+    // Log that the train is ready to go in the associated direction
+    curr_train->ready_ns = now_ns() - event_log.start_ns;
+    log_event(curr_train, STATE_READY);
+
+    // Hand the current train to the dispatcher through the ready stack for its direction, then count it
+    ready_push(curr_train->direction == 'E' || curr_train->direction == 'e' ? &ready_east : &ready_west, curr_train);
+    atomic_fetch_add(&total_loaded, 1);
+
+    // Signal that the train has been loaded, taking the mutex only if the dispatcher is asleep waiting for it
+    if (atomic_load(&dispatcher_waiting) == true)
+    {
+        pthread_mutex_lock(&load_mutex);
+        pthread_cond_signal(&load_cond);
+        pthread_mutex_unlock(&load_mutex);
+    }
+}
+
+// Run queued train steps until the pool is stopped
+void *pool_worker(void *arg)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&pool.mutex);
+        while (pool.total == 0 && pool.stop == false)
+            pthread_cond_wait(&pool.cond, &pool.mutex);
+        if (pool.total == 0)
+        {
+            pthread_mutex_unlock(&pool.mutex);
+            return NULL;
+        }
+        train_t *curr_train = pool.ring[pool.head];
+        pool.head = (pool.head + 1) % pool.capacity;
+        pool.total--;
+        pthread_mutex_unlock(&pool.mutex);
+
+        run_task(curr_train);
+    }
 }
 
-// Load the train and push to the appropriate east or west stations
-void *load_train(void *arg)
+// Queue a list of handed over trains at their stations, holding back on the early list any train that finished loading after tick now, so the stations hold exactly the trains they hold at that tick in the virtual time simulation
+void admit_ready(train_t *list, long now, train_t **early)
 {
-    train_t *curr_train = arg;
+    while (list != NULL)
+    {
+        train_t *curr_train = list;
+        list = list->ready_next;
+        if (curr_train->loading_time > now)
+        {
+            curr_train->ready_next = *early;
+            *early = curr_train;
+        }
+        else
+            curr_train->direction == 'E' || curr_train->direction == 'e' ? push(&station_east, curr_train) : push(&station_west, curr_train);
+    }
+}
 
-    char *direction = curr_train->direction == 'E' || 'e' ? "East" : "West";
+// Order loading times ascending
+int compare_loading_time(const void *a, const void *b)
+{
+    int x = *(const int *)a, y = *(const int *)b;
+    return x < y ? -1 : x > y;
+}
 
-    // Sleep the program for the appropriate amount of time in seconds
-    usleep(curr_train->loading_time * 100000);
+// Dispatch the schedule in real time, tick by tick: at each tick a train finishes loading or leaves a track, wait for the timer wheel to empty the tracks whose trains leave and for the workers to hand over every train loaded by then, queue those trains at their stations, put a chosen train on every free track and arm the timer that clears it. Returns once every train is off its track
+void send_train(train_t *train, int total_trains)
+{
+    // Loading times in ascending order, so the dispatcher knows how many trains must have loaded by any tick
+    int *loading = malloc(total_trains * sizeof(*loading));
+    for (int i = 0; i < total_trains; i++)
+        loading[i] = train[i].loading_time;
+    qsort(loading, total_trains, sizeof(*loading), compare_loading_time);
 
-    // Print that the train is ready to go in the associated direction
-    print_output(curr_train, "READY");
+    dispatch_t dispatch = {0};
+    // The dispatcher's clock runs in ticks, so every decision is made at the same tick it is in the virtual time simulation
+    long now = 0;
+    int due = 0;
+    train_t **chosen = malloc(total_tracks * sizeof(*chosen));
+    train_t *early = NULL;
+    while (true)
+    {
+        // Wait for the timer wheel to empty every track whose train leaves by now
+        for (int i = 0; i < total_tracks; i++)
+        {
+            if (tracks[i].train == NULL || tracks[i].off_tick > now)
+                continue;
+            pthread_mutex_lock(&tracks[i].mutex);
+            while (tracks[i].busy == true)
+                pthread_cond_wait(&tracks[i].cond, &tracks[i].mutex);
+            pthread_mutex_unlock(&tracks[i].mutex);
+            log_event(tracks[i].train, STATE_OFF);
+            tracks[i].train = NULL;
+        }
 
-    // Lock the station mutex and push the current train to the appropriate east or west station
-    pthread_mutex_lock(&station_mutex);
-    curr_train->direction == 'E' || curr_train->direction == 'e' ? push(&station_east, curr_train) : push(&station_west, curr_train);
-    pthread_mutex_unlock(&station_mutex);
+        // Wait until every train that finishes loading by now has been handed over; the workers see dispatcher_waiting before they could miss the wakeup, or the dispatcher sees their count
+        while (due < total_trains && loading[due] <= now)
+            due++;
+        if (atomic_load(&total_loaded) < due)
+        {
+            pthread_mutex_lock(&load_mutex);
+            atomic_store(&dispatcher_waiting, true);
+            while (atomic_load(&total_loaded) < due)
+                pthread_cond_wait(&load_cond, &load_mutex);
+            atomic_store(&dispatcher_waiting, false);
+            pthread_mutex_unlock(&load_mutex);
+        }
 
-    // Signal that the train has been loaded and is ready to be placed on the main track
-    pthread_cond_signal(&load_cond);
-    // Wait until the current train is ready to be placed on the track
-    while (curr_train->ready != true);
+        // The station heaps belong to the dispatcher alone: take both ready stacks and queue their trains, then choose a train for every free track
+        train_t *held = early;
+        early = NULL;
+        admit_ready(held, now, &early);
+        admit_ready(atomic_exchange_explicit(&ready_east, NULL, memory_order_acquire), now, &early);
+        admit_ready(atomic_exchange_explicit(&ready_west, NULL, memory_order_acquire), now, &early);
+        long long decided = now_ns();
+        int total_chosen = 0;
+        for (int i = free_track(); i != -1 && (is_empty(&station_east) == false || is_empty(&station_west) == false); i = free_track())
+        {
+            train_t *curr_train = dispatch_next(&dispatch);
+            curr_train->dispatch_ns = decided;
+            curr_train->track = i;
+            tracks[i].train = curr_train;
+            tracks[i].off_tick = now + curr_train->crossing_time;
+            chosen[total_chosen++] = curr_train;
+        }
 
-    print_output(curr_train, "ON");
-    usleep(curr_train->crossing_time * 100000);
-    print_output(curr_train, "OFF");
+        // The dispatcher owns the tracks: it puts each chosen train on its track itself, so no other thread has to wake up before the train is ON, and arms the timer that empties the track
+        for (int i = 0; i < total_chosen; i++)
+        {
+            track_t *track = &tracks[chosen[i]->track];
+            pthread_mutex_lock(&track->mutex);
+            chosen[i]->on_tick = now;
+            track->busy = true;
+            pthread_mutex_unlock(&track->mutex);
+            record_on_latency(chosen[i]);
+            log_event(chosen[i], STATE_ON);
+            metrics_on(chosen[i], now_ns() - event_log.start_ns);
+            wheel_schedule(chosen[i], track->off_tick, TASK_OFF);
+        }
 
-    // Signal that the train is ready to cross the main track
-    pthread_cond_signal(&cross_cond);
+        // Move on to the next tick a train finishes loading or leaves a track, and stop once there is none
+        long next = due < total_trains ? loading[due] : -1;
+        for (int i = 0; i < total_tracks; i++)
+            if (tracks[i].train != NULL && (next == -1 || tracks[i].off_tick < next))
+                next = tracks[i].off_tick;
+        if (next == -1)
+            break;
+        now = next;
+    }
+    free(chosen);
+    free(loading);
 }
 
-// Pop the train with the highest priority from the appropriate station queue
-void send_train(int total_trains)
+// Kinds of events in the virtual time simulation; at the same tick, a train leaves the main track before trains finishing loading are queued
+enum event_kind_t
+{
+    EVENT_OFF,
+    EVENT_READY
+};
+
+// A load-complete or cross-complete event in the virtual time simulation
+typedef struct event_t
+{
+    long tick;
+    enum event_kind_t kind;
+    train_t *train;
+} event_t;
+
+// Binary min-heap of events ordered by tick, then kind, then train number
+typedef struct event_heap_t
+{
+    event_t *events;
+    int total_events;
+} event_heap_t;
+
+// Return true if event a happens before event b
+bool event_before(const event_t *a, const event_t *b)
 {
-    // Directional character used to determine which train should be popped from the station queue
-    char direction[1];
-    // Counter to track how many trains have been sent in each direction
-    int sent_east, sent_west = 0;
-    for (int i = total_trains - 1; i >= 0; i--)
+    if (a->tick != b->tick)
+        return a->tick < b->tick;
+    if (a->kind != b->kind)
+        return a->kind < b->kind;
+    return a->train->train_number < b->train->train_number;
+}
+
+// Add an event to the heap, sifting it up to its place
+void event_push(event_heap_t *heap, long tick, enum event_kind_t kind, train_t *train)
+{
+    int i = heap->total_events++;
+    event_t event = {tick, kind, train};
+    while (i > 0 && event_before(&event, &heap->events[(i - 1) / 2]))
     {
-        // Lock the track mutex and determine the train with the highest priority
-        pthread_mutex_lock(&track_mutex);
+        heap->events[i] = heap->events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->events[i] = event;
+}
 
-        // If both east and west stations are empty, then wait until it is not
-        if (is_empty(&station_east) == true && is_empty(&station_west) == true)
-            pthread_cond_wait(&load_cond, &track_mutex);
+// Remove and return the earliest event, sifting the last event down into the hole
+event_t event_pop(event_heap_t *heap)
+{
+    event_t first = heap->events[0];
+    event_t last = heap->events[--heap->total_events];
+    int i = 0;
+    while (true)
+    {
+        int child = 2 * i + 1;
+        if (child >= heap->total_events)
+            break;
+        if (child + 1 < heap->total_events && event_before(&heap->events[child + 1], &heap->events[child]))
+            child++;
+        if (event_before(&last, &heap->events[child]) == true)
+            break;
+        heap->events[i] = heap->events[child];
+        i = child;
+    }
+    heap->events[i] = last;
+    return first;
+}
+
+// Run the schedule in virtual time: jump from one event to the next instead of sleeping, making the same decisions at the same ticks as send_train. Return the tick the last train leaves its track at
+long simulate(train_t *train, int total_trains)
+{
+    // Every train has one pending event at a time, loading and then crossing
+    event_heap_t heap = {malloc((total_trains + 1) * sizeof(event_t)), 0};
+    for (int i = 0; i < total_trains; i++)
+        event_push(&heap, train[i].loading_time, EVENT_READY, &train[i]);
 
-        // If both stations or one of the stations are not empty, check the starvation case and set the priority direction accordingly
-        if (is_empty(&station_east) == false && is_empty(&station_west) == false)
+    dispatch_t dispatch = {0};
+    long now = 0;
+    while (heap.total_events > 0)
+    {
+        event_t event = event_pop(&heap);
+        now = event.tick;
+        if (event.kind == EVENT_READY)
+        {
+            event.train->ready_ns = (long long)now * TICK_NS;
+            log_event_at(event.train, STATE_READY, now);
+            event.train->direction == 'E' || event.train->direction == 'e' ? push(&station_east, event.train) : push(&station_west, event.train);
+        }
+        else
         {
-            sent_east == 4 ? strncpy(direction, "W", 1) : strncpy(direction, "E", 1);
-            sent_west == 4 ? strncpy(direction, "E", 1) : strncpy(direction, "E", 1);
-            sent_east = sent_east == 4 ? 0 : sent_east;
-            sent_west = sent_west == 4 ? 0 : sent_west;
-            station_east->priority > station_west->priority ? strncpy(direction, "E", 1) : strncpy(direction, "W", 1);
+            log_event_at(event.train, STATE_OFF, now);
+            tracks[event.train->track].train = NULL;
         }
-        else if (is_empty(&station_east) == false && is_empty(&station_west) == true)
-            strncpy(direction, "E", 1);
-        else if (is_empty(&station_east) == true && is_empty(&station_west) == false)
-            strncpy(direction, "W", 1);
 
-        // Check the direction character, increment the appropriate direction counter, set the train's ready state to true and pop it from the station queue
-        if (strcmp(direction, "E") == 0)
+        // Decide only once every event of this tick is handled, choosing a waiting train for every free track
+        if (heap.total_events > 0 && heap.events[0].tick == now)
+            continue;
+        for (int i = free_track(); i != -1 && (is_empty(&station_east) == false || is_empty(&station_west) == false); i = free_track())
         {
-            sent_east++;
-            station_east->train_data->ready = true;
-            pthread_mutex_lock(&station_mutex);
-            pop(&station_east);
-            pthread_mutex_unlock(&station_mutex);
-            sent_west = 0;
+            train_t *curr_train = dispatch_next(&dispatch);
+            curr_train->track = i;
+            tracks[i].train = curr_train;
+            curr_train->on_tick = now;
+            log_event_at(curr_train, STATE_ON, now);
+            metrics_on(curr_train, (long long)now * TICK_NS);
+            event_push(&heap, now + curr_train->crossing_time, EVENT_OFF, curr_train);
         }
-        else if (strcmp(direction, "W") == 0)
+    }
+    free(heap.events);
+    return now;
+}
+
+// One loader's share of the trains in the handoff benchmark, handed over under a mutex if one is given and through a ready stack otherwise
+typedef struct handoff_t
+{
+    train_t *trains;
+    int total_trains;
+    pthread_mutex_t *mutex;
+    pthread_barrier_t *barrier;
+    atomic_int *arrived;
+} handoff_t;
+
+// Hand over a share of the trains in the handoff benchmark once every loader is ready to start
+void *handoff_loader(void *arg)
+{
+    handoff_t *handoff = arg;
+    atomic_fetch_add(handoff->arrived, 1);
+    pthread_barrier_wait(handoff->barrier);
+    for (int i = 0; i < handoff->total_trains; i++)
+    {
+        if (handoff->mutex != NULL)
         {
-            sent_west++;
-            station_west->train_data->ready = true;
-            pthread_mutex_lock(&station_mutex);
-            pop(&station_west);
-            pthread_mutex_unlock(&station_mutex);
-            sent_east = 0;
+            pthread_mutex_lock(handoff->mutex);
+            push(&station_east, &handoff->trains[i]);
+            pthread_mutex_unlock(handoff->mutex);
         }
-        // Wait for the crossing condition to be met
-        pthread_cond_wait(&cross_cond, &track_mutex);
-        pthread_mutex_unlock(&track_mutex);
+        else
+            ready_push(&ready_east, &handoff->trains[i]);
     }
+    return NULL;
+}
+
+// Hand 100000 trains that all finish loading at the same tick to one station from 1 to 8 loader threads, pushing into the heap under a shared mutex as the loaders used to, and through a ready stack the dispatcher drains into its own heap, reported with -b
+void bench_handoff(void)
+{
+    int total_trains = 100000;
+    train_t *train = malloc(total_trains * sizeof(*train));
+    station_east.trains = malloc(total_trains * sizeof(train_t *));
+    memset(station_east.trains, 0, total_trains * sizeof(train_t *));
+    for (int i = 0; i < total_trains; i++)
+    {
+        train[i].train_number = i;
+        train[i].direction = 'E';
+        train[i].priority = 1;
+        train[i].loading_time = 1;
+    }
+    for (int total_loaders = 1; total_loaders <= 8; total_loaders *= 2)
+    {
+        double ns[2];
+        for (int lock_free = 0; lock_free <= 1; lock_free++)
+        {
+            pthread_mutex_t mutex;
+            pthread_mutex_init(&mutex, NULL);
+            pthread_barrier_t barrier;
+            pthread_barrier_init(&barrier, NULL, total_loaders + 1);
+            atomic_int arrived = 0;
+            handoff_t handoff[8];
+            pthread_t loaders[8];
+            station_east.total_trains = 0;
+            for (int i = 0; i < total_loaders; i++)
+            {
+                handoff[i].trains = train + (long)total_trains * i / total_loaders;
+                handoff[i].total_trains = (long)total_trains * (i + 1) / total_loaders - (long)total_trains * i / total_loaders;
+                handoff[i].mutex = lock_free == 1 ? NULL : &mutex;
+                handoff[i].barrier = &barrier;
+                handoff[i].arrived = &arrived;
+                pthread_create(&loaders[i], NULL, &handoff_loader, &handoff[i]);
+            }
+
+            // Start the clock once every loader is waiting at the barrier, and with the ready stack drain it into the heap while the loaders push
+            struct timespec begin, end;
+            while (atomic_load(&arrived) < total_loaders)
+                sched_yield();
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+            pthread_barrier_wait(&barrier);
+            while (lock_free == 1 && station_east.total_trains < total_trains)
+            {
+                train_t *list = atomic_exchange_explicit(&ready_east, NULL, memory_order_acquire);
+                if (list == NULL)
+                    sched_yield();
+                for (; list != NULL; list = list->ready_next)
+                    push(&station_east, list);
+            }
+            for (int i = 0; i < total_loaders; i++)
+                pthread_join(loaders[i], NULL);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            ns[lock_free] = ((end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec)) / total_trains;
+            pthread_barrier_destroy(&barrier);
+            pthread_mutex_destroy(&mutex);
+        }
+        printf("%d loader%s: mutex %6.1f ns, ready stack %6.1f ns per train\n", total_loaders, total_loaders == 1 ? " " : "s", ns[0], ns[1]);
+    }
+    free(station_east.trains);
+    free(train);
+}
+
+// Simulate the same random schedule in virtual time on 1 to 8 tracks and report how many trains cross per simulated hour, reported with -b
+void bench_tracks(void)
+{
+    int total_trains = 100000;
+    train_t *train = malloc(total_trains * sizeof(*train));
+    train_t **slots = malloc(2 * (total_trains + 1) * sizeof(*slots));
+    station_east.trains = slots;
+    station_west.trains = slots + total_trains + 1;
+    quiet = true;
+    for (total_tracks = 1; total_tracks <= 8; total_tracks *= 2)
+    {
+        // Trains finish loading over the first simulated minute, so the tracks are the bottleneck
+        srand(360);
+        for (int i = 0; i < total_trains; i++)
+        {
+            train[i].train_number = i;
+            train[i].direction = "EeWw"[rand() % 4];
+            train[i].priority = train[i].direction == 'E' || train[i].direction == 'W' ? 1 : 0;
+            train[i].loading_time = 1 + rand() % 600;
+            train[i].crossing_time = 1 + rand() % 10;
+        }
+        tracks = calloc(total_tracks, sizeof(*tracks));
+        long ticks = simulate(train, total_trains);
+        printf("%d track%s: %7.0f trains per simulated hour\n", total_tracks, total_tracks == 1 ? " " : "s", total_trains * 36000.0 / ticks);
+        free(tracks);
+    }
+    quiet = false;
+    total_tracks = 1;
+    free(slots);
+    free(train);
+}
+
+// Time pushing a batch of trains onto a station and popping them all off again, for 10^3 to 10^6 queued trains, reported with -b
+void bench_stations(void)
+{
+    srand(360);
+    for (int total_trains = 1000; total_trains <= 1000000; total_trains *= 10)
+    {
+        train_t *train = malloc(total_trains * sizeof(*train));
+        station_t station = {malloc(total_trains * sizeof(train_t *)), 0};
+        for (int i = 0; i < total_trains; i++)
+        {
+            train[i].train_number = i;
+            train[i].priority = rand() % 2;
+            train[i].loading_time = 1 + rand() % 99;
+        }
+
+        // Push the trains in input file order, the way they arrive when their loading times are shuffled
+        struct timespec begin, middle, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        for (int i = 0; i < total_trains; i++)
+            push(&station, &train[i]);
+        clock_gettime(CLOCK_MONOTONIC, &middle);
+
+        // Pop them all, checking that they come off in the order they leave the station
+        bool in_order = true;
+        train_t *prev = NULL;
+        while (is_empty(&station) == false)
+        {
+            train_t *curr_train = pop(&station);
+            if (prev != NULL && leaves_before(curr_train, prev) == true)
+                in_order = false;
+            prev = curr_train;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        double push_ns = (middle.tv_sec - begin.tv_sec) * 1e9 + (middle.tv_nsec - begin.tv_nsec);
+        double pop_ns = (end.tv_sec - middle.tv_sec) * 1e9 + (end.tv_nsec - middle.tv_nsec);
+        printf("%7d trains: push %6.1f ns, pop %6.1f ns%s\n", total_trains, push_ns / total_trains, pop_ns / total_trains, in_order == true ? "" : " (out of order)");
+        free(station.trains);
+        free(train);
+    }
+}
+
+// Trains parsed from one run of whole lines of the manifest, in an array grown geometrically as lines are read
+typedef struct chunk_t
+{
+    const char *begin;
+    const char *end;
+    train_t *trains;
+    int total_trains;
+    int capacity;
+    // Start of the first malformed line, or NULL if every line parsed
+    const char *error;
+} chunk_t;
+
+// Advance the cursor past spaces and tabs, returning how many were skipped
+int skip_blanks(const char **cursor, const char *end)
+{
+    const char *c = *cursor;
+    while (c < end && (*c == ' ' || *c == '\t'))
+        c++;
+    int skipped = c - *cursor;
+    *cursor = c;
+    return skipped;
+}
+
+// Read a decimal integer of any width, advancing the cursor past it; return -1 if there are no digits or the value does not fit in an int
+int parse_int(const char **cursor, const char *end)
+{
+    const char *c = *cursor;
+    long long value = 0;
+    if (c == end || *c < '0' || *c > '9')
+        return -1;
+    for (; c < end && *c >= '0' && *c <= '9'; c++)
+    {
+        value = value * 10 + (*c - '0');
+        if (value > INT_MAX)
+            return -1;
+    }
+    *cursor = c;
+    return (int)value;
+}
+
+// Parse every line of a chunk into a train: a direction, the loading time and the crossing time, separated by blanks. Blank lines are skipped, and a line may end in \r\n or run to the end of the file
+void *parse_chunk(void *arg)
+{
+    chunk_t *chunk = arg;
+    const char *c = chunk->begin, *end = chunk->end;
+    while (c < end)
+    {
+        const char *line = c;
+        skip_blanks(&c, end);
+        if (c < end && *c == '\r')
+            c++;
+        if (c < end && *c == '\n')
+        {
+            c++;
+            continue;
+        }
+        if (c == end)
+            break;
+
+        char direction = *c++;
+        int loading_time = skip_blanks(&c, end) > 0 ? parse_int(&c, end) : -1;
+        int crossing_time = loading_time != -1 && skip_blanks(&c, end) > 0 ? parse_int(&c, end) : -1;
+        skip_blanks(&c, end);
+        if (c < end && *c == '\r')
+            c++;
+        if ((direction != 'E' && direction != 'e' && direction != 'W' && direction != 'w') || crossing_time == -1 || (c < end && *c != '\n'))
+        {
+            chunk->error = line;
+            return NULL;
+        }
+        c++;
+
+        // Double the array when it fills up, so a manifest of n lines costs O(log n) reallocations
+        if (chunk->total_trains == chunk->capacity)
+        {
+            chunk->capacity = chunk->capacity == 0 ? 1024 : chunk->capacity * 2;
+            chunk->trains = realloc(chunk->trains, chunk->capacity * sizeof(*chunk->trains));
+        }
+        train_t *curr_train = &chunk->trains[chunk->total_trains++];
+        // If the train direction is 'E' or 'W' set the priority as 1 (high), else set it as 0 (low)
+        curr_train->priority = direction == 'E' || direction == 'W' ? 1 : 0;
+        curr_train->direction = direction;
+        curr_train->loading_time = loading_time;
+        curr_train->crossing_time = crossing_time;
+        curr_train->on_tick = 0;
+        curr_train->timer_next = NULL;
+        curr_train->wait_ns = 0;
+    }
+    return NULL;
+}
+
+// Map the manifest and parse it in a single pass, splitting it into one run of whole lines per thread, and number the trains in file order. Return the number of trains, or -1 if the file cannot be read or a line is malformed
+int parse_manifest(const char *path, int total_threads, train_t **train, long long *size)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        perror("Error at fp");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        perror("Error at fstat");
+        close(fd);
+        return -1;
+    }
+    *size = st.st_size;
+    char *data = NULL;
+    if (*size > 0)
+    {
+        data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+        {
+            perror("Error at mmap");
+            close(fd);
+            return -1;
+        }
+        madvise(data, *size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    // Cut the file into roughly equal chunks, moving every cut past the end of the line it falls in
+    chunk_t *chunks = calloc(total_threads, sizeof(*chunks));
+    pthread_t *threads = malloc(total_threads * sizeof(*threads));
+    const char *begin = data, *file_end = data + *size;
+    for (int i = 0; i < total_threads; i++)
+    {
+        const char *end = i == total_threads - 1 ? file_end : data + *size / total_threads * (i + 1);
+        if (end < begin)
+            end = begin;
+        const char *newline = end < file_end ? memchr(end, '\n', file_end - end) : NULL;
+        chunks[i].begin = begin;
+        chunks[i].end = i == total_threads - 1 || newline == NULL ? file_end : newline + 1;
+        begin = chunks[i].end;
+    }
+
+    // The calling thread parses the first chunk while the others parse the rest
+    for (int i = 1; i < total_threads; i++)
+        if (pthread_create(&threads[i], NULL, &parse_chunk, &chunks[i]) != 0)
+        {
+            perror("Error at threads[i]");
+            parse_chunk(&chunks[i]);
+            threads[i] = 0;
+        }
+    parse_chunk(&chunks[0]);
+    for (int i = 1; i < total_threads; i++)
+        if (threads[i] != 0)
+            pthread_join(threads[i], NULL);
+
+    // Report the first malformed line by its line number, counted only when there is one
+    int total_trains = 0;
+    for (int i = 0; i < total_threads && total_trains != -1; i++)
+    {
+        if (chunks[i].error != NULL)
+        {
+            int line = 1;
+            for (const char *c = data; c < chunks[i].error; c++)
+                line += *c == '\n';
+            printf("Error: line %d of the input file is malformed\n", line);
+            total_trains = -1;
+        }
+        else if (chunks[i].total_trains > INT_MAX - total_trains)
+        {
+            printf("Error: the input file holds more than %d trains\n", INT_MAX);
+            total_trains = -1;
+        }
+        else
+            total_trains += chunks[i].total_trains;
+    }
+
+    // Append the other chunks to the first one's array, freeing each as it is copied
+    *train = NULL;
+    if (total_trains != -1)
+    {
+        *train = realloc(chunks[0].trains, (total_trains + 1) * sizeof(**train));
+        chunks[0].trains = NULL;
+        int copied = chunks[0].total_trains;
+        for (int i = 1; i < total_threads; i++)
+        {
+            memcpy(*train + copied, chunks[i].trains, chunks[i].total_trains * sizeof(**train));
+            copied += chunks[i].total_trains;
+            free(chunks[i].trains);
+            chunks[i].trains = NULL;
+        }
+        for (int i = 0; i < total_trains; i++)
+            (*train)[i].train_number = i;
+    }
+    for (int i = 0; i < total_threads; i++)
+        free(chunks[i].trains);
+    free(threads);
+    free(chunks);
+    if (data != NULL)
+        munmap(data, *size);
+    return total_trains;
 }
 
 int main(int argc, char *argv[])
 {
+    // With -v the schedule is simulated in virtual time instead of being played out in real time, and with -l the parse time and dispatch latency are reported. -j splits parsing the input file across threads, and -p stops once it is parsed. -f writes the schedule as text, csv or json, and -m summarizes the scheduler metrics when it ends. -b benchmarks the station queues instead of running a schedule
+    bool virtual_time = false;
+    bool parse_only = false;
+    int parse_threads = 1;
+    enum log_format_t format = FORMAT_TEXT;
+    bool format_known = true;
+    int option;
+    while ((option = getopt(argc, argv, "vlmbt:j:pf:")) != -1)
+    {
+        if (option == 'v')
+            virtual_time = true;
+        else if (option == 'l')
+            report_latency = true;
+        else if (option == 'm')
+            report_metrics = true;
+        else if (option == 'b')
+        {
+            bench_stations();
+            bench_handoff();
+            bench_tracks();
+            return 0;
+        }
+        else if (option == 't')
+            total_tracks = atoi(optarg);
+        else if (option == 'j')
+            parse_threads = atoi(optarg);
+        else if (option == 'p')
+            parse_only = true;
+        else if (option == 'f')
+        {
+            format_known = strcmp(optarg, "text") == 0 || strcmp(optarg, "csv") == 0 || strcmp(optarg, "json") == 0;
+            format = strcmp(optarg, "csv") == 0 ? FORMAT_CSV : strcmp(optarg, "json") == 0 ? FORMAT_JSON : FORMAT_TEXT;
+        }
+        else
+            optind = argc + 1;
+    }
     // If the input arguments are less than 2, print an error message and exit the program
-    if (argv[1] == NULL)
+    if (optind != argc - 1 || total_tracks < 1 || parse_threads < 1 || format_known == false)
     {
         printf("Expected input file of the form: *.txt\n");
+        printf("Expected: ./mts [-v] [-l] [-m] [-p] [-t tracks] [-j parse threads] [-f text|csv|json] <input file>\n");
+        printf("Expected: ./mts -b\n");
         exit(1);
     }
 
-    // Open the trains.txt file in read mode, and check whether an error is produced when it's opened
-    FILE *fp = fopen(argv[1], "r");
-    if (fp == NULL)
-        perror("Error at fp");
+    // Read every train in the input file, assigning each its direction, priority, and loading and crossing times
+    train_t *train;
+    long long manifest_size;
+    long long parse_begin = now_ns();
+    int total_trains = parse_manifest(argv[optind], parse_threads, &train, &manifest_size);
+    if (total_trains == -1)
+        exit(1);
+    if (report_latency == true || parse_only == true)
+    {
+        double parse_ms = (now_ns() - parse_begin) / 1000000.0;
+        fprintf(stderr, "Parsed %d trains from %.1f MB in %.1f ms with %d thread%s\n", total_trains, manifest_size / 1048576.0, parse_ms, parse_threads, parse_threads == 1 ? "" : "s");
+    }
+    if (parse_only == true)
+    {
+        free(train);
+        return 0;
+    }
 
-    // Start the clock timer
-    if (clock_gettime(CLOCK_REALTIME, &start) == -1)
-        perror("Error at clock_gettime with start");
+    // Every train can end up waiting at the same station, so both stations take their slots from one block big enough for that
+    train_t **slots = malloc(2 * (total_trains + 1) * sizeof(*slots));
+    station_east.trains = slots;
+    station_west.trains = slots + total_trains + 1;
 
-    // Count the number of lines in the input file and have that be the total number of trains
-    int total_trains = 0;
-    for (int c = getc(fp); c != EOF; c = getc(fp))
-        if (c == '\n')
-            total_trains++;
-    // Set the file pointer to the beginning, so that it can be read in-order again
-    rewind(fp);
+    // Every track starts out free, with its own lock and condition variable
+    tracks = calloc(total_tracks, sizeof(*tracks));
+    for (int i = 0; i < total_tracks; i++)
+    {
+        pthread_mutex_init(&tracks[i].mutex, NULL);
+        pthread_cond_init(&tracks[i].cond, NULL);
+    }
 
-    // Allocate memory for all trains in the input file
-    train_t *train = malloc(total_trains * sizeof(*train));
+    // Start the clock timer, and the writer for the event log
+    if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+        perror("Error at clock_gettime with start");
+    if (log_start(train, virtual_time, format) == -1)
+        exit(1);
 
-    char col1[1], col2[3], col3[3];
-    int i = 0;
-    // Read each column of the input file and assign the appropriate attributes to each train
-    while (fscanf(fp, "%s %s %s", col1, col2, col3) != EOF)
+    if (virtual_time == true)
     {
-        train[i].train_number = i;
-        // If the train direction is 'E' or 'W' set the priority as 1 (high), else set it as 0 (low)
-        train[i].priority = col1[0] == 'E' || col1[0] == 'W' ? 1 : 0;
-        train[i].direction = col1[0];
-        train[i].loading_time = atoi(col2);
-        train[i].crossing_time = atoi(col3);
-        // Set the trains default ready status to false
-        train[i].ready = false;
-        // Increment the train number index
-        i++;
-    }
-    // Close the input file
-    fclose(fp);
-
-    // Initialize a mutex for the station and track
-    pthread_mutex_init(&station_mutex, NULL);
-    pthread_mutex_init(&track_mutex, NULL);
-
-    // Initialize a condition variable for loading and crossing
-    pthread_cond_init(&load_cond, NULL);
-    pthread_cond_init(&cross_cond, NULL);
+        simulate(train, total_trains);
+        log_stop();
+        if (report_metrics == true)
+            print_metrics(train, total_trains);
+        free(tracks);
+        free(slots);
+        free(train);
+        return 0;
+    }
 
-    // Initialize a thread for each of the lines read in the input file
-    pthread_t train_thread[total_trains];
+    // Initialize a mutex and a condition variable for the dispatcher to sleep on until trains are loaded
+    pthread_mutex_init(&load_mutex, NULL);
+    pthread_cond_init(&load_cond, NULL);
 
-    // Create a thread for each train in the input file and check whether an error is produced
+    // Arm a loading timer for every train; a train that loads instantly is queued as soon as the pool starts
+    pthread_mutex_init(&wheel.mutex, NULL);
+    wheel.fired = 0;
+    pool.capacity = total_trains + 1;
+    pool.ring = malloc(pool.capacity * sizeof(*pool.ring));
+    pthread_mutex_init(&pool.mutex, NULL);
+    pthread_cond_init(&pool.cond, NULL);
     for (int i = 0; i < total_trains; i++)
+        wheel_schedule(&train[i], train[i].loading_time, TASK_READY);
+
+    // One worker per core runs the train steps, however many trains there are, and one more thread turns the timer wheel
+    long total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pool.total_threads = total_threads < 1 ? 1 : total_threads;
+    pool.threads = malloc(pool.total_threads * sizeof(*pool.threads));
+    int started = 0;
+    for (int i = 0; i < pool.total_threads; i++)
+    {
+        if (pthread_create(&pool.threads[started], NULL, &pool_worker, NULL) != 0)
+            perror("Error at pool.threads[i]");
+        else
+            started++;
+    }
+    // Fewer workers only run the steps more slowly, and only the ones that started are joined; without any worker, or without the wheel to fire the timers, the dispatcher would wait forever
+    pool.total_threads = started;
+    if (started == 0)
+    {
+        printf("Error: no worker thread could be started\n");
+        exit(1);
+    }
+    pthread_t wheel_thread;
+    if (pthread_create(&wheel_thread, NULL, &wheel_turn, NULL) != 0)
     {
-        if (pthread_create(&train_thread[i], NULL, &load_train, (void *)&train[i]) != 0)
-            perror("Error at train_thread[i]");
+        perror("Error at wheel_thread");
+        exit(1);
     }
 
     // Dispatch the correct sequence of trains
-    send_train(total_trains);
-
-    // Join all of the train threads
-    for (int i = 0; i < total_trains; i++)
-        pthread_join(train_thread[i], NULL);
+    send_train(train, total_trains);
 
-    // Destroy both mutexes variables
-    pthread_mutex_destroy(&station_mutex);
-    pthread_mutex_destroy(&track_mutex);
+    // Every train is off its track, so stop the wheel, let the workers finish, and write out the rest of the log
+    pthread_mutex_lock(&wheel.mutex);
+    wheel.stop = true;
+    pthread_mutex_unlock(&wheel.mutex);
+    pthread_join(wheel_thread, NULL);
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = true;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.mutex);
+    for (int i = 0; i < pool.total_threads; i++)
+        pthread_join(pool.threads[i], NULL);
+    log_stop();
+    free(pool.threads);
+    free(pool.ring);
+    pthread_mutex_destroy(&wheel.mutex);
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_cond_destroy(&pool.cond);
 
-    // Destroy both condition variables
+    // Destroy the loading and track mutexes and condition variables
+    pthread_mutex_destroy(&load_mutex);
     pthread_cond_destroy(&load_cond);
-    pthread_cond_destroy(&cross_cond);
+    for (int i = 0; i < total_tracks; i++)
+    {
+        pthread_mutex_destroy(&tracks[i].mutex);
+        pthread_cond_destroy(&tracks[i].cond);
+    }
 
+    if (report_latency == true && on_latency.count > 0)
+        fprintf(stderr, "Dispatch to ON: %d trains, mean %.1f us, max %.1f us\n", on_latency.count, on_latency.total_ns / 1000.0 / on_latency.count, on_latency.max_ns / 1000.0);
+    if (report_metrics == true)
+        print_metrics(train, total_trains);
+    free(tracks);
+    free(slots);
+    free(train);
     return 0;
 }
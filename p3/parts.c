@@ -12,6 +12,15 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Super block: adapted from the tutorial slides
 struct __attribute__((__packed__)) superblock_t
@@ -49,426 +58,4296 @@ struct __attribute__((__packed__)) dir_entry_t
     uint8_t unused[6];
 };
 
-void diskinfo(int argc, char *argv[])
+// Write the entire buffer to the output file descriptor, retrying on short or interrupted writes
+int write_all(int out, const uint8_t *data, size_t length)
 {
-    // Check if the user input is valid
-    if (argc != 2)
+    while (length > 0)
     {
-        printf("Expected: ./diskinfo <disk image>\n");
-        exit(1);
+        ssize_t written = write(out, data, length);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        length -= written;
     }
+    return 0;
+}
 
-    // Open the disk image for reading and writing
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1)
-        perror("Error at fd");
+// Contiguous run of blocks in the image
+struct extent_t
+{
+    uint32_t start;
+    uint32_t length;
+};
 
-    // Return information about the disk image
-    struct stat buffer;
-    fstat(fd, &buffer);
+// Number of blocks that have both a FAT entry and backing storage in the image
+uint32_t image_block_count(const uint8_t *image, size_t image_size)
+{
+    struct superblock_t *sb = (struct superblock_t *)image;
+    uint32_t size = ntohs(sb->block_size);
+    uint64_t block_count = ntohl(sb->file_system_block_count);
+    uint64_t fat_entries = (uint64_t)ntohl(sb->fat_block_count) * size / 4;
+    block_count = block_count < fat_entries ? block_count : fat_entries;
+    block_count = block_count < image_size / size ? block_count : image_size / size;
+    return block_count;
+}
 
-    // Create a new mapping in the virtual address space
-    void *address = mmap(NULL, buffer.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (address == (void *)-1)
-        perror("Error at address");
+// Read a FAT entry in host byte order
+uint32_t fat_entry(const uint8_t *fat, uint32_t block)
+{
+    uint32_t val;
+    memcpy(&val, fat + (size_t)block * 4, 4);
+    return ntohl(val);
+}
 
-    // Initialize a new super block structure with the mapping of the address space
-    struct superblock_t *sb;
-    sb = (struct superblock_t *)address;
+// How the walk of a chain ended
+enum chain_end_t
+{
+    CHAIN_END,
+    CHAIN_LIMIT,
+    CHAIN_OUT_OF_RANGE,
+    CHAIN_UNALLOCATED,
+    CHAIN_CYCLE
+};
 
-    // Initialize the start and end location variables to their corresponding values in the FAT table
-    int start = ntohl(sb->fat_start_block) * htons(sb->block_size);
-    int end = ntohl(sb->fat_block_count) * htons(sb->block_size);
-    // Initialize the number of free, reserved and allocated blocks to 0 initially
-    int free, reserved, allocated = 0;
+// Position of a walk along a FAT chain; every block it returns is in range and allocated, and it never follows more than its limit, so a cyclic chain cannot trap it
+struct chain_walk_t
+{
+    const uint8_t *fat;
+    uint32_t block_count;
+    uint32_t next;
+    uint32_t remaining;
+    enum chain_end_t end;
+    uint32_t end_block;
+};
 
-    // Loop from the start of the FAT black to the end, incrementing by 4 each time
-    for (int i = start; i < start + end; i += 4)
+// Start a walk at the given block that returns at most limit blocks
+void chain_walk_begin(struct chain_walk_t *walk, const uint8_t *fat, uint32_t block_count, uint32_t start, uint32_t limit)
+{
+    walk->fat = fat;
+    walk->block_count = block_count;
+    walk->next = start;
+    walk->remaining = limit;
+    walk->end = CHAIN_END;
+    walk->end_block = 0xFFFFFFFF;
+}
+
+// Step to the next block of the chain; returns false once the chain ends, the limit is reached or the chain turns out to be broken, with the reason in walk->end
+bool chain_walk_next(struct chain_walk_t *walk, uint32_t *block)
+{
+    uint32_t b = walk->next;
+    if (b == 0xFFFFFFFF)
+        walk->end = CHAIN_END;
+    else if (walk->remaining == 0)
+        walk->end = CHAIN_LIMIT;
+    else if (b >= walk->block_count)
+        walk->end = CHAIN_OUT_OF_RANGE;
+    else
     {
-        int val = 0;
-        memcpy(&val, address + i, 4);
-        val = htonl(val);
-        // Depending on the value at the address + i space, increment the appropriate variable
-        val == 0 ? free++ : val == 1 ? reserved++
-                                     : allocated++;
+        uint32_t next = fat_entry(walk->fat, b);
+        if (next == 0 || next == 1)
+            walk->end = CHAIN_UNALLOCATED;
+        else
+        {
+            walk->next = next;
+            walk->remaining--;
+            *block = b;
+            return true;
+        }
     }
+    walk->end_block = b;
+    return false;
+}
 
-    // Print the appropriate super block information
-    printf("Super block information:\n");
-    printf("Block size: %d\n", htons(sb->block_size));
-    printf("Block count: %d\n", ntohl(sb->file_system_block_count));
-    printf("FAT starts: %d\n", ntohl(sb->fat_start_block));
-    printf("FAT blocks: %d\n", ntohl(sb->fat_block_count));
-    printf("Root directory start: %d\n", ntohl(sb->root_dir_start_block));
-    printf("Root directory blocks: %d\n\n", ntohl(sb->root_dir_block_count));
+// A chain resolved in one pass into runs of physically contiguous blocks
+struct chain_t
+{
+    struct extent_t *extents;
+    int total_extents;
+    int capacity;
+    uint32_t total_blocks;
+    enum chain_end_t end;
+    uint32_t end_block;
+};
 
-    // Print the appropriate FAT information
-    printf("FAT information:\n");
-    printf("Free Blocks: %d\n", free);
-    printf("Reserved Blocks: %d\n", reserved);
-    printf("Allocated Blocks: %d\n", allocated);
+// Resolve at most limit blocks of the chain starting at start into extents
+void chain_resolve(const uint8_t *fat, uint32_t block_count, uint32_t start, uint32_t limit, struct chain_t *chain)
+{
+    memset(chain, 0, sizeof(*chain));
 
-    // Delete the mappings for the address range and close the file
-    munmap(address, buffer.st_size);
-    close(fd);
+    struct chain_walk_t walk;
+    chain_walk_begin(&walk, fat, block_count, start, limit);
+    uint32_t block;
+    while (chain_walk_next(&walk, &block) == true)
+    {
+        chain->total_blocks++;
+
+        // Grow the last extent if this block directly follows it, otherwise start a new one
+        struct extent_t *last = chain->total_extents > 0 ? &chain->extents[chain->total_extents - 1] : NULL;
+        if (last != NULL && last->start + last->length == block)
+        {
+            last->length++;
+            continue;
+        }
+        if (chain->total_extents == chain->capacity)
+        {
+            chain->capacity = chain->capacity == 0 ? 16 : chain->capacity * 2;
+            chain->extents = realloc(chain->extents, chain->capacity * sizeof(*chain->extents));
+        }
+        chain->extents[chain->total_extents++] = (struct extent_t){block, 1};
+    }
+    chain->end = walk.end;
+    chain->end_block = walk.end_block;
 }
 
-void disklist(int argc, char **argv)
+// Release the memory held by a resolved chain
+void chain_destroy(struct chain_t *chain)
+{
+    free(chain->extents);
+}
+
+// In-memory index of the free blocks in the FAT, built once per image open
+struct free_index_t
+{
+    // One bit per block, set while the block is free
+    uint8_t *bitmap;
+    // Maximal runs of free blocks, sorted by starting block
+    struct extent_t *extents;
+    int total_extents;
+    uint32_t free_blocks;
+    uint32_t block_count;
+};
+
+// Scan the FAT once, recording every free block in the bitmap and coalescing neighbouring free blocks into extents
+void free_index_build(struct free_index_t *index, const uint8_t *image, size_t image_size)
 {
-    if (argc != 3 || strcmp(argv[2], "/") != false)
+    struct superblock_t *sb = (struct superblock_t *)image;
+    uint32_t size = ntohs(sb->block_size);
+    const uint8_t *fat = image + (size_t)ntohl(sb->fat_start_block) * size;
+
+    // Only consider blocks that have both a FAT entry and backing storage in the image
+    uint32_t block_count = image_block_count(image, image_size);
+
+    index->block_count = block_count;
+    index->bitmap = calloc(block_count / 8 + 1, 1);
+    index->extents = NULL;
+    index->total_extents = 0;
+    index->free_blocks = 0;
+    int capacity = 0;
+
+    for (uint32_t b = 0; b < block_count; b++)
     {
-        printf("Expected: ./disklist <disk image> /\n");
-        exit(1);
-    }
+        uint32_t val;
+        memcpy(&val, fat + (size_t)b * 4, 4);
+        if (val != 0)
+            continue;
 
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1)
-        perror("Error at fd");
+        index->bitmap[b / 8] |= 1 << (b % 8);
+        index->free_blocks++;
 
-    struct stat buffer;
-    fstat(fd, &buffer);
+        // Grow the previous extent if this block directly follows it, otherwise start a new one
+        struct extent_t *last = index->total_extents > 0 ? &index->extents[index->total_extents - 1] : NULL;
+        if (last != NULL && last->start + last->length == b)
+        {
+            last->length++;
+            continue;
+        }
+        if (index->total_extents == capacity)
+        {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            index->extents = realloc(index->extents, capacity * sizeof(*index->extents));
+        }
+        index->extents[index->total_extents++] = (struct extent_t){b, 1};
+    }
+}
 
-    void *address = mmap(NULL, buffer.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (address == (void *)-1)
-        perror("Error at address");
+// Order extents from largest to smallest, breaking ties by lowest starting block
+int compare_extent_length(const void *a, const void *b)
+{
+    const struct extent_t *x = a, *y = b;
+    if (x->length != y->length)
+        return x->length > y->length ? -1 : 1;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
 
-    struct superblock_t *sb;
-    sb = (struct superblock_t *)address;
+// Order extents by their starting block
+int compare_extent_start(const void *a, const void *b)
+{
+    const struct extent_t *x = a, *y = b;
+    return x->start < y->start ? -1 : x->start > y->start;
+}
 
-    int size = htons(sb->block_size);
-    int start = ntohl(sb->root_dir_start_block) * size;
+// Claim need blocks using the fewest and largest free runs; returns the number of runs written to *out in block order, or -1 if there is not enough space
+int free_index_alloc(struct free_index_t *index, uint32_t need, struct extent_t **out)
+{
+    *out = NULL;
+    if (need > index->free_blocks)
+        return -1;
+    if (need == 0)
+        return 0;
 
-    // Create a new variable corresponding to the rootblock of the directory entry
-    struct dir_entry_t *rb;
+    // Prefer the smallest single extent that holds the whole file, so the large runs stay available for large files
+    int best = -1;
+    for (int e = 0; e < index->total_extents; e++)
+        if (index->extents[e].length >= need && (best == -1 || index->extents[e].length < index->extents[best].length))
+            best = e;
 
-    // Loop from the start of the block to the end, incrementing by 64 each time
-    for (int i = start; i < start + size; i += 64)
+    int total_out = 0;
+    if (best != -1)
     {
-        // Set the rootblock variable to the value of the memory location at address + i
-        rb = (struct dir_entry_t *)(address + i);
-        // If the size of the rootblock is 0, skip the entry entirely
-        if (ntohl(rb->size) == 0)
-            continue;
-        // Print the correct information pertaining to the disk image
-        printf("%c %10d %30s %4d/%02d/%02d %02d:%02d:%02d\n", rb->status == 3 ? 'F' : 'D', ntohl(rb->size), rb->filename, htons(rb->modify_time.year),
-               rb->modify_time.month, rb->modify_time.day, rb->modify_time.hour, rb->modify_time.minute, rb->modify_time.second);
+        *out = malloc(sizeof(**out));
+        (*out)[total_out++] = (struct extent_t){index->extents[best].start, need};
+        index->extents[best].start += need;
+        index->extents[best].length -= need;
     }
+    else
+    {
+        // No single run fits, so take whole runs from the largest down until the file is covered
+        struct extent_t *by_length = malloc(index->total_extents * sizeof(*by_length));
+        memcpy(by_length, index->extents, index->total_extents * sizeof(*by_length));
+        qsort(by_length, index->total_extents, sizeof(*by_length), compare_extent_length);
 
-    munmap(address, buffer.st_size);
-    close(fd);
+        *out = malloc(index->total_extents * sizeof(**out));
+        uint32_t remaining = need;
+        for (int e = 0; remaining > 0; e++)
+        {
+            uint32_t take = by_length[e].length < remaining ? by_length[e].length : remaining;
+            (*out)[total_out++] = (struct extent_t){by_length[e].start, take};
+            remaining -= take;
+        }
+        free(by_length);
+
+        // Chain the claimed runs in ascending block order so the file reads front to back across the image
+        qsort(*out, total_out, sizeof(**out), compare_extent_start);
+
+        // Shrink or empty every extent that a claimed run was taken from
+        for (int c = 0, e = 0; c < total_out; c++)
+        {
+            while (index->extents[e].start != (*out)[c].start)
+                e++;
+            index->extents[e].start += (*out)[c].length;
+            index->extents[e].length -= (*out)[c].length;
+        }
+    }
+
+    // Clear the claimed blocks in the bitmap and drop extents that are now empty
+    for (int c = 0; c < total_out; c++)
+        for (uint32_t b = (*out)[c].start; b < (*out)[c].start + (*out)[c].length; b++)
+            index->bitmap[b / 8] &= ~(1 << (b % 8));
+    int kept = 0;
+    for (int e = 0; e < index->total_extents; e++)
+        if (index->extents[e].length > 0)
+            index->extents[kept++] = index->extents[e];
+    index->total_extents = kept;
+    index->free_blocks -= need;
+
+    return total_out;
 }
 
-void diskget(int argc, char *argv[])
+// Release the memory held by the free space index
+void free_index_destroy(struct free_index_t *index)
 {
-    if (argc != 4)
+    free(index->bitmap);
+    free(index->extents);
+}
+
+// Number of free, reserved and allocated entries in the FAT
+struct fat_census_t
+{
+    uint64_t free;
+    uint64_t reserved;
+    uint64_t allocated;
+};
+
+// Classify one FAT entry at a time; also finishes the entries left over by the vector kernels
+void fat_census_scalar(const uint8_t *fat, size_t entries, struct fat_census_t *census)
+{
+    for (size_t i = 0; i < entries; i++)
     {
-        printf("Expected: ./diskget <disk image> /<disk file> <local file>\n");
-        exit(1);
+        uint32_t val;
+        memcpy(&val, fat + i * 4, 4);
+        val = ntohl(val);
+        val == 0 ? census->free++ : val == 1 ? census->reserved++
+                                             : census->allocated++;
     }
+}
 
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1)
-        perror("Error at fd");
+#if defined(__x86_64__) || defined(__i386__)
+// Classify 8 entries per iteration with SSE2. Entries are compared in disk byte order against 0 and htonl(1), so no byte swap is needed
+void fat_census_sse2(const uint8_t *fat, size_t entries, struct fat_census_t *census)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi32(htonl(1));
+    __m128i free_lanes = _mm_setzero_si128();
+    __m128i reserved_lanes = _mm_setzero_si128();
 
-    struct stat buffer;
-    fstat(fd, &buffer);
+    // Each matching lane compares to -1, so subtracting the comparison mask counts the match
+    size_t i = 0;
+    for (; i + 8 <= entries; i += 8)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(fat + i * 4));
+        __m128i b = _mm_loadu_si128((const __m128i *)(fat + i * 4 + 16));
+        free_lanes = _mm_sub_epi32(free_lanes, _mm_cmpeq_epi32(a, zero));
+        free_lanes = _mm_sub_epi32(free_lanes, _mm_cmpeq_epi32(b, zero));
+        reserved_lanes = _mm_sub_epi32(reserved_lanes, _mm_cmpeq_epi32(a, one));
+        reserved_lanes = _mm_sub_epi32(reserved_lanes, _mm_cmpeq_epi32(b, one));
+    }
 
-    // Grab the name of the file and strip the "/" character from the input
-    char *file_name = argv[2];
-    char *last_arg = argv[3];
-    // If there is no "/" character in the appropriate position, exit in error and notify the user
-    if (file_name[0] != 47 || last_arg[0] == 47)
+    uint32_t lanes[4];
+    uint64_t free = 0, reserved = 0;
+    _mm_storeu_si128((__m128i *)lanes, free_lanes);
+    for (int l = 0; l < 4; l++)
+        free += lanes[l];
+    _mm_storeu_si128((__m128i *)lanes, reserved_lanes);
+    for (int l = 0; l < 4; l++)
+        reserved += lanes[l];
+
+    census->free += free;
+    census->reserved += reserved;
+    census->allocated += i - free - reserved;
+    fat_census_scalar(fat + i * 4, entries - i, census);
+}
+
+// Classify 16 entries per iteration with AVX2, using the same compare and subtract scheme as the SSE2 kernel
+__attribute__((target("avx2"))) void fat_census_avx2(const uint8_t *fat, size_t entries, struct fat_census_t *census)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(htonl(1));
+    __m256i free_lanes = _mm256_setzero_si256();
+    __m256i reserved_lanes = _mm256_setzero_si256();
+
+    size_t i = 0;
+    for (; i + 16 <= entries; i += 16)
     {
-        printf("Expected: ./diskget <disk image> /<disk file> <local file>\n");
-        exit(1);
+        __m256i a = _mm256_loadu_si256((const __m256i *)(fat + i * 4));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(fat + i * 4 + 32));
+        free_lanes = _mm256_sub_epi32(free_lanes, _mm256_cmpeq_epi32(a, zero));
+        free_lanes = _mm256_sub_epi32(free_lanes, _mm256_cmpeq_epi32(b, zero));
+        reserved_lanes = _mm256_sub_epi32(reserved_lanes, _mm256_cmpeq_epi32(a, one));
+        reserved_lanes = _mm256_sub_epi32(reserved_lanes, _mm256_cmpeq_epi32(b, one));
     }
-    memmove(&file_name[0], &file_name[1], strlen(file_name));
 
-    // Initialize a buffer with the maximum amount of readable information
-    char file_data[1000];
-    strcpy(file_data, file_name);
+    uint32_t lanes[8];
+    uint64_t free = 0, reserved = 0;
+    _mm256_storeu_si256((__m256i *)lanes, free_lanes);
+    for (int l = 0; l < 8; l++)
+        free += lanes[l];
+    _mm256_storeu_si256((__m256i *)lanes, reserved_lanes);
+    for (int l = 0; l < 8; l++)
+        reserved += lanes[l];
 
-    void *address = mmap(NULL, buffer.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (address == (void *)-1)
-        perror("Error at address");
+    census->free += free;
+    census->reserved += reserved;
+    census->allocated += i - free - reserved;
+    fat_census_scalar(fat + i * 4, entries - i, census);
+}
+#endif
 
-    struct superblock_t *sb;
-    sb = (struct superblock_t *)address;
-
-    int size = htons(sb->block_size);
-    int start = htonl(sb->root_dir_start_block) * size;
-    void *file = mmap(NULL, htonl(sb->file_system_block_count) * size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-
-    // Initialize variables for the file size, status and file_found boolean
-    int fs;
-    char status;
-    bool file_found = false;
-
-    int idx = 0;
-    // Loop from the initial 0th index to the start of the block, incrementing by 64 each time
-    for (int i = 0; i < start; i += 64)
-    {
-        // Copy the status of the address space into the status varialbe
-        memcpy(&status, file + start + i, 1);
-
-        // Create a temporary buffer to copy information from certain address spaces
-        char tmp[1000];
-        memcpy(&fs, file + start + i + 9, 4);
-        fs = ntohl(fs);
-        for (int j = 27; j < 54; j++)
-        {
-            // Copy the status of the current address space into the status variable each loop
-            memcpy(&status, file + start + i + j, 1);
-            // Set the current index value to the status variable
-            tmp[idx] = status;
-            // Increment the current working index
-            idx++;
-        }
-        idx = 0;
-
-        // If the file_data and temporary variable contain the same information then continue
-        if (strcmp(tmp, file_data) == false)
-        {
-            // The file has been found
-            file_found = true;
-
-            // Open the appopriate file on the user's local machine in writing mode
-            FILE *out = fopen(argv[3], "w");
-
-            // Copy data from the appropriate location in memory and store it within the file size variable
-            memcpy(&fs, file + start + i + 5, 4);
-            // Convert the unsigned integer to nhost byte order, after each memory copy operation
-            fs = ntohl(fs);
-            memcpy(&fs, file + start + i + 9, 4);
-            fs = ntohl(fs);
-            int file_size = fs;
-            memcpy(&fs, file + start + i + 1, 4);
-            fs = ntohl(fs);
-
-            char file_buffer;
-            // While the file size variable doesn't result in error, particularly reaching the end of the file, continue looping
-            while (fs != -1)
-            {
-                // If the current file size is greater than the total file size continue writing to the appropriate output file
-                if (file_size > size)
-                {
-                    for (int i = 0; i < size; i++)
-                    {
-                        memcpy(&file_buffer, file + size * fs + i, 1);
-                        fwrite(&file_buffer, sizeof(char), 1, out);
-                    }
-                    // Decrement the current file size by the total file size, to get the remaining total
-                    file_size -= size;
-                }
-                // If not, continue writing to the appropriate output file
-                else
-                {
-                    for (int i = 0; i < file_size; i++)
-                    {
-                        memcpy(&file_buffer, file + size * fs + i, 1);
-                        fwrite(&file_buffer, sizeof(char), 1, out);
-                    }
-                }
+// Count the free, reserved and allocated FAT entries with the widest kernel the CPU supports
+void fat_census(const uint8_t *fat, size_t entries, struct fat_census_t *census)
+{
+    memset(census, 0, sizeof(*census));
+#if defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("avx2"))
+        fat_census_avx2(fat, entries, census);
+    else if (__builtin_cpu_supports("sse2"))
+        fat_census_sse2(fat, entries, census);
+    else
+#endif
+        fat_census_scalar(fat, entries, census);
+}
 
-                // Copy data from the final address space in the block to the file size vriable
-                memcpy(&fs, file + htonl(sb->fat_start_block) * size + fs * 4, 4);
-                fs = ntohl(fs);
-            }
+// Lookup table for CRC32C on processors without the crc32 instruction, filled in by crc32c_init
+uint32_t crc32c_table[256];
+
+void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) != 0 ? crc >> 1 ^ 0x82F63B78 : crc >> 1;
+        crc32c_table[i] = crc;
+    }
+}
+
+// CRC32C of each of count consecutive blocks, one byte at a time
+void crc32c_blocks_scalar(const uint8_t *data, uint32_t size, uint32_t count, uint32_t *sums)
+{
+    for (uint32_t b = 0; b < count; b++)
+    {
+        const uint8_t *block = data + (size_t)b * size;
+        uint32_t crc = 0xFFFFFFFF;
+        for (uint32_t i = 0; i < size; i++)
+            crc = crc >> 8 ^ crc32c_table[(crc ^ block[i]) & 0xFF];
+        sums[b] = ~crc;
+    }
+}
 
-            fclose(out);
+#if defined(__x86_64__)
+// CRC32C of each of count consecutive blocks with the SSE4.2 crc32 instruction; it takes three cycles but can start every cycle, so three blocks are summed side by side
+__attribute__((target("sse4.2"))) void crc32c_blocks_sse42(const uint8_t *data, uint32_t size, uint32_t count, uint32_t *sums)
+{
+    uint32_t b = 0;
+    for (; b + 3 <= count; b += 3)
+    {
+        const uint8_t *x = data + (size_t)b * size, *y = x + size, *z = y + size;
+        uint64_t cx = 0xFFFFFFFF, cy = 0xFFFFFFFF, cz = 0xFFFFFFFF;
+        uint32_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t wx, wy, wz;
+            memcpy(&wx, x + i, 8);
+            memcpy(&wy, y + i, 8);
+            memcpy(&wz, z + i, 8);
+            cx = _mm_crc32_u64(cx, wx);
+            cy = _mm_crc32_u64(cy, wy);
+            cz = _mm_crc32_u64(cz, wz);
+        }
+        for (; i < size; i++)
+        {
+            cx = _mm_crc32_u8(cx, x[i]);
+            cy = _mm_crc32_u8(cy, y[i]);
+            cz = _mm_crc32_u8(cz, z[i]);
         }
+        sums[b] = ~(uint32_t)cx;
+        sums[b + 1] = ~(uint32_t)cy;
+        sums[b + 2] = ~(uint32_t)cz;
     }
-    // If the file is not found return an error; else notify the user of successful completion
-    if (file_found == false)
+    for (; b < count; b++)
     {
-        printf("Error: file not found\n");
-        exit(1);
+        const uint8_t *x = data + (size_t)b * size;
+        uint64_t cx = 0xFFFFFFFF;
+        uint32_t i = 0;
+        for (; i + 8 <= size; i += 8)
+        {
+            uint64_t wx;
+            memcpy(&wx, x + i, 8);
+            cx = _mm_crc32_u64(cx, wx);
+        }
+        for (; i < size; i++)
+            cx = _mm_crc32_u8(cx, x[i]);
+        sums[b] = ~(uint32_t)cx;
     }
-    else
-        printf("Success: found %s in %s\n", argv[2], argv[1]);
+}
+#endif
 
-    munmap(address, buffer.st_size);
-    close(fd);
+// CRC32C of each of count consecutive blocks, using the crc32 instruction when the processor has it
+void crc32c_blocks(const uint8_t *data, uint32_t size, uint32_t count, uint32_t *sums)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_blocks_sse42(data, size, count, sums);
+    else
+#endif
+        crc32c_blocks_scalar(data, size, count, sums);
 }
 
-void diskput(int argc, char *argv[])
+// A directory loaded once into a hash table of file name to slot, alongside the list of unused slots
+struct dir_index_t
 {
-    if (argc != 4)
+    // First block of the directory, which names it as a parent in the dentry cache
+    uint32_t start;
+    // Every slot of the directory in order, since a subdirectory's blocks need not be contiguous
+    struct dir_entry_t **entries;
+    int total_entries;
+    // Head slot of each bucket and the next slot in the same bucket, -1 terminated
+    int *buckets;
+    int *chain;
+    int total_buckets;
+    // Unused slots, with the lowest slot on top of the stack
+    int *free_slots;
+    int total_free;
+    // NUL terminated name of every slot in use, including slots claimed by updates that are not yet committed to the image
+    char (*names)[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+    // Private copy the slots point into when the directory lies beyond the mapping, or NULL
+    uint8_t *copy;
+};
+
+// FNV-1a hash over a file name of at most the length of the filename field
+uint32_t dir_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < sizeof(((struct dir_entry_t *)0)->filename) && name[i] != '\0'; i++)
     {
-        printf("Expected: ./diskput <disk image> <local file> /<disk file>\n");
-        exit(1);
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    int fd = open(argv[1], O_RDWR);
-    if (fd == -1)
-        perror("Error at fd");
+// Add a slot to the front of its name's bucket
+void dir_index_link(struct dir_index_t *dir, int slot)
+{
+    uint32_t bucket = dir_name_hash(dir->names[slot]) & (dir->total_buckets - 1);
+    dir->chain[slot] = dir->buckets[bucket];
+    dir->buckets[bucket] = slot;
+}
 
-    struct stat buffer_tp;
-    fstat(fd, &buffer_tp);
+// Gather a pointer to every slot in a directory's extents, never reading past the end of the image; returns the number of slots
+int dir_slots(uint8_t *image, size_t image_size, const struct extent_t *extents, int total_extents, struct dir_entry_t ***slots)
+{
+    struct superblock_t *sb = (struct superblock_t *)image;
+    uint32_t size = ntohs(sb->block_size);
+    int total_slots = 0;
+    *slots = NULL;
 
-    int f_tu = open(argv[2], O_RDWR);
-    if (f_tu == -1)
+    for (int e = 0; e < total_extents; e++)
     {
-        printf("Error: file not found\n");
-        exit(1);
+        size_t first = (size_t)extents[e].start * size;
+        size_t end = first + (size_t)extents[e].length * size;
+        if (first > image_size)
+            first = image_size;
+        if (end > image_size)
+            end = image_size;
+
+        int count = (end - first) / sizeof(struct dir_entry_t);
+        *slots = realloc(*slots, (total_slots + count + 1) * sizeof(**slots));
+        for (int i = 0; i < count; i++)
+            (*slots)[total_slots++] = (struct dir_entry_t *)(image + first) + i;
     }
+    return total_slots;
+}
 
-    struct stat buffer_tu;
-    fstat(f_tu, &buffer_tu);
+// Index the gathered slots of a directory once, hashing every entry in use and stacking every unused slot; the index takes over the slots and any copy they point into
+void dir_index_build(struct dir_index_t *dir, uint32_t start, struct dir_entry_t **slots, int total_slots, uint8_t *copy)
+{
+    dir->start = start;
+    dir->entries = slots;
+    dir->total_entries = total_slots;
+    dir->copy = copy;
+
+    // Keep the table at most half full so buckets stay short
+    dir->total_buckets = 16;
+    while (dir->total_buckets < dir->total_entries * 2)
+        dir->total_buckets *= 2;
+    dir->buckets = malloc(dir->total_buckets * sizeof(*dir->buckets));
+    memset(dir->buckets, -1, dir->total_buckets * sizeof(*dir->buckets));
+    dir->chain = malloc((dir->total_entries + 1) * sizeof(*dir->chain));
+    dir->free_slots = malloc((dir->total_entries + 1) * sizeof(*dir->free_slots));
+    dir->names = calloc(dir->total_entries + 1, sizeof(*dir->names));
+    dir->total_free = 0;
 
-    char *file_name = argv[3];
-    if (file_name[0] != 47)
+    // Walk the slots backwards so the lowest free slot ends up on top of the stack
+    for (int i = dir->total_entries - 1; i >= 0; i--)
     {
-        printf("Expected: ./diskput <disk image> <local file> /<disk file>\n");
-        exit(1);
+        if ((dir->entries[i]->status & 0x01) == 0)
+            dir->free_slots[dir->total_free++] = i;
+        else
+        {
+            memcpy(dir->names[i], dir->entries[i]->filename, sizeof(dir->entries[i]->filename));
+            dir_index_link(dir, i);
+        }
     }
-    memmove(&file_name[0], &file_name[1], strlen(file_name));
-    int file_size = buffer_tu.st_size;
-
-    FILE *fp;
-    fp = fopen(argv[2], "r");
+}
 
-    void *address = mmap(NULL, buffer_tp.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (address == (void *)-1)
-        perror("Error at address");
+// Return the entry in use with the given name, or NULL if there is none
+struct dir_entry_t *dir_index_find(struct dir_index_t *dir, const char *name)
+{
+    uint32_t bucket = dir_name_hash(name) & (dir->total_buckets - 1);
+    for (int slot = dir->buckets[bucket]; slot != -1; slot = dir->chain[slot])
+        if (strncmp(dir->names[slot], name, sizeof(dir->entries[slot]->filename)) == 0)
+            return dir->entries[slot];
+    return NULL;
+}
 
-    struct superblock_t *sb;
-    sb = (struct superblock_t *)address;
+// Claim the lowest unused slot for a new file and record its name in the index; the caller writes the entry itself. Returns NULL if the directory is full
+struct dir_entry_t *dir_index_insert(struct dir_index_t *dir, const char *name)
+{
+    if (dir->total_free == 0)
+        return NULL;
 
-    int size = htons(sb->block_size);
-    int start = ntohl(sb->fat_start_block) * size;
-    int block = ntohl(sb->root_dir_start_block) * size;
-    int end = (ntohl(sb->fat_start_block) + ntohl(sb->fat_block_count)) * size;
+    int slot = dir->free_slots[--dir->total_free];
+    strncpy(dir->names[slot], name, sizeof(dir->entries[slot]->filename));
+    dir_index_link(dir, slot);
+    return dir->entries[slot];
+}
 
-    // Create a variable declaring the needed file size by computing a modulo operation on the remnant value, and incrementing appropriately
-    int need = file_size / size;
-    file_size % size != 0 ? need++ : need;
+// Release the memory held by the directory index
+void dir_index_destroy(struct dir_index_t *dir)
+{
+    free(dir->entries);
+    free(dir->copy);
+    free(dir->buckets);
+    free(dir->chain);
+    free(dir->free_slots);
+    free(dir->names);
+}
 
-    // Declare a variable with the amount of memory used
-    int used = 0;
-    int memory_idx = 0, starting_idx = 0;
-    char tmp[1000];
-    // Loop from the beginning of the block to the end, incrementing by 4 each time
-    for (int i = start; i < end; i += 4)
-    {
-        int idx = 0;
-        // Copy the value of the address space into the current index value
-        memcpy(&idx, address + i, 4);
-        // Convert the unsigned integer to network byte order
-        idx = htonl(idx);
-        if (idx == 0)
-        {
-            // If no memory has been currently used, update the starting index and read from the appropriate local file
-            if (used == 0)
-            {
-                starting_idx = (i - start) / 4;
-                used++;
+// A subdirectory that has been looked up, keyed by the first block of its parent and its name
+struct dentry_t
+{
+    uint32_t parent;
+    char name[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+    struct dir_index_t *dir;
+    // Next dentry in the same bucket, -1 terminated
+    int next;
+};
 
-                fread(tmp, size, 1, fp);
-                memcpy(address + (starting_idx * size), &tmp, size);
-            }
-            // Update the memory index location
-            memory_idx = (i - start) / 4;
+// Every subdirectory resolved so far, so walking a path costs one probe per level instead of parsing each directory again
+struct dentry_cache_t
+{
+    struct dentry_t *dentries;
+    int total_dentries;
+    int *buckets;
+    int total_buckets;
+};
 
-            // Read from the local file and copy the apportiate data from the location in memory
-            fread(tmp, size, 1, fp);
-            memcpy(address + (memory_idx * size), &tmp, size);
+// Bucket of a parent block and name pair
+uint32_t dentry_bucket(struct dentry_cache_t *cache, uint32_t parent, const char *name)
+{
+    return (dir_name_hash(name) ^ parent * 2654435761u) & (cache->total_buckets - 1);
+}
 
-            // Convert the memory index variable from an unsigned integer to network byte order
-            memory_idx = htonl(memory_idx);
-            memcpy(address + i, &memory_idx, 4);
+// Return the cached index of the subdirectory name of parent, or NULL if it has not been resolved yet
+struct dir_index_t *dentry_find(struct dentry_cache_t *cache, uint32_t parent, const char *name)
+{
+    if (cache->total_buckets == 0)
+        return NULL;
+    for (int i = cache->buckets[dentry_bucket(cache, parent, name)]; i != -1; i = cache->dentries[i].next)
+        if (cache->dentries[i].parent == parent && strncmp(cache->dentries[i].name, name, sizeof(cache->dentries[i].name) - 1) == 0)
+            return cache->dentries[i].dir;
+    return NULL;
+}
 
-            // Increment the amount of memory used
-            used++;
+// Cache the index of the subdirectory name of parent, which the cache owns from then on
+void dentry_add(struct dentry_cache_t *cache, uint32_t parent, const char *name, struct dir_index_t *dir)
+{
+    // Keep the table at most half full, doubling it and relinking every dentry when it fills up
+    if (cache->total_dentries * 2 >= cache->total_buckets)
+    {
+        cache->total_buckets = cache->total_buckets == 0 ? 64 : cache->total_buckets * 2;
+        cache->buckets = realloc(cache->buckets, cache->total_buckets * sizeof(*cache->buckets));
+        memset(cache->buckets, -1, cache->total_buckets * sizeof(*cache->buckets));
+        cache->dentries = realloc(cache->dentries, cache->total_buckets / 2 * sizeof(*cache->dentries));
+        for (int i = 0; i < cache->total_dentries; i++)
+        {
+            uint32_t bucket = dentry_bucket(cache, cache->dentries[i].parent, cache->dentries[i].name);
+            cache->dentries[i].next = cache->buckets[bucket];
+            cache->buckets[bucket] = i;
         }
     }
 
-    // Set the status of the file added to the disk image as "F"
-    int status = 3;
-    // Loop from the beginning of the file to the end, incrementing by 64 each time
-    for (int i = block; i < block + size; i += 64)
-    {
-        int idx = 0;
-        // Copy the data from the current address space into the index value
-        memcpy(&idx, address + i, 1);
-
-        if (idx == 0)
-        {
-            // Get the value of the local time zone
-            time_t rawtime;
-            time(&rawtime);
-            // From time.h create a structure used to hold the time and date
-            struct tm *info = localtime(&rawtime);
-
-            // Create a buffer that holds the time information
-            char buffer_time[10];
-            int time;
-
-            // Set the added file in the disk image as "F" for the type
-            memcpy(address + i, &status, 1);
-
-            // Set the attributes for the file added in the disk image
-            starting_idx = ntohl(starting_idx);
-            memcpy(address + i + 1, &starting_idx, 4);
-
-            file_size = htonl(file_size);
-            memcpy(address + i + 9, &file_size, 4);
-
-            // Get the current year
-            strftime(buffer_time, sizeof(buffer_time), "%Y", info);
-            sscanf(buffer_time, "%d", &time);
-            // Convert the unsigned short interger to a network byte
-            time = htons(time);
-            memcpy(address + i + 20, &time, 2);
-
-            // Get the current month
-            strftime(buffer_time, sizeof(buffer_time), "%m", info);
-            sscanf(buffer_time, "%d", &time);
-            memcpy(address + i + 22, &time, 1);
-
-            // Get the current day
-            strftime(buffer_time, sizeof(buffer_time), "%d", info);
-            sscanf(buffer_time, "%d", &time);
-            memcpy(address + i + 23, &time, 1);
-
-            // Get the current hour
-            strftime(buffer_time, sizeof(buffer_time), "%H", info);
-            sscanf(buffer_time, "%d", &time);
-            memcpy(address + i + 24, &time, 1);
-
-            // Get the current month
-            strftime(buffer_time, sizeof(buffer_time), "%M", info);
-            sscanf(buffer_time, "%d", &time);
-            memcpy(address + i + 25, &time, 1);
-
-            // Get the current seconds
-            strftime(buffer_time, sizeof(buffer_time), "%S", info);
-            sscanf(buffer_time, "%d", &time);
-            memcpy(address + i + 26, &time, 1);
-
-            // Set the desired file name in the disk image
-            strncpy(address + i + 27, file_name, 31);
+    struct dentry_t *dentry = &cache->dentries[cache->total_dentries];
+    dentry->parent = parent;
+    strncpy(dentry->name, name, sizeof(dentry->name) - 1);
+    dentry->name[sizeof(dentry->name) - 1] = '\0';
+    dentry->dir = dir;
+    uint32_t bucket = dentry_bucket(cache, parent, dentry->name);
+    dentry->next = cache->buckets[bucket];
+    cache->buckets[bucket] = cache->total_dentries++;
+}
 
-            break;
-        }
+// Release every cached subdirectory index and the cache itself, leaving it empty
+void dentry_cache_destroy(struct dentry_cache_t *cache)
+{
+    for (int i = 0; i < cache->total_dentries; i++)
+    {
+        dir_index_destroy(cache->dentries[i].dir);
+        free(cache->dentries[i].dir);
     }
-    // Notify the user of what the file was placed as in the disk image
-    printf("Success: placed %s as %s in %s\n", argv[2], argv[3], argv[1]);
+    free(cache->dentries);
+    free(cache->buckets);
+    memset(cache, 0, sizeof(*cache));
+}
 
-    munmap(address, buffer_tp.st_size);
-    close(fd);
-    close(f_tu);
-    fclose(fp);
+// Hash a block's bytes into a running 64 bit digest, eight bytes at a time
+uint64_t block_hash(const uint8_t *data, size_t length, uint64_t hash)
+{
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash ^= word * 0x9E3779B97F4A7C15ull;
+        hash = (hash << 31 | hash >> 33) * 0xC2B2AE3D27D4EB4Full;
+    }
+    for (; i < length; i++)
+        hash = (hash ^ data[i]) * 0x100000001B3ull;
+    return hash ^ hash >> 29;
 }
 
-void diskfix(int argc, char *argv[])
+// A file in the image whose chain a deduplicating put may share
+struct dedup_file_t
 {
-    if (argc != 2)
+    uint32_t size;
+    uint32_t start;
+    // Digest of the file's contents, computed the first time another file of the same size is put
+    uint64_t digest;
+    bool hashed;
+    // A chain that turned out to be broken while hashing is never shared
+    bool broken;
+    // Next file in the same bucket, -1 terminated
+    int next;
+};
+
+// Files in the image keyed by size, so only files of the same size are ever hashed and compared
+struct dedup_index_t
+{
+    struct dedup_file_t *files;
+    int total_files;
+    int capacity;
+    int *buckets;
+    int total_buckets;
+};
+
+// Add a file to the front of its size's bucket, doubling the table whenever it gets half full
+void dedup_add(struct dedup_index_t *index, uint32_t size, uint32_t start, uint64_t digest, bool hashed)
+{
+    if (index->total_files == index->capacity)
     {
-        printf("Expected: ./diskfix <disk image>\n");
-        exit(1);
+        index->capacity = index->capacity == 0 ? 64 : index->capacity * 2;
+        index->files = realloc(index->files, index->capacity * sizeof(*index->files));
     }
-    printf("Not attempted 😭\n");
+    if (index->total_files * 2 >= index->total_buckets)
+    {
+        index->total_buckets = index->total_buckets == 0 ? 128 : index->total_buckets * 2;
+        index->buckets = realloc(index->buckets, index->total_buckets * sizeof(*index->buckets));
+        memset(index->buckets, -1, index->total_buckets * sizeof(*index->buckets));
+        for (int i = 0; i < index->total_files; i++)
+        {
+            uint32_t bucket = index->files[i].size * 2654435761u & (index->total_buckets - 1);
+            index->files[i].next = index->buckets[bucket];
+            index->buckets[bucket] = i;
+        }
+    }
+
+    struct dedup_file_t *file = &index->files[index->total_files];
+    file->size = size;
+    file->start = start;
+    file->digest = digest;
+    file->hashed = hashed;
+    file->broken = false;
+    uint32_t bucket = size * 2654435761u & (index->total_buckets - 1);
+    file->next = index->buckets[bucket];
+    index->buckets[bucket] = index->total_files++;
+}
+
+// Release the memory held by the deduplication index
+void dedup_destroy(struct dedup_index_t *index)
+{
+    free(index->files);
+    free(index->buckets);
+    memset(index, 0, sizeof(*index));
+}
+
+// Largest single read issued while streaming a local file into the image
+#define INGEST_CHUNK (8 << 20)
+// Amount of newly written data after which the dirtied part of the image is flushed
+#define INGEST_FLUSH (64 << 20)
+
+// Span of the image dirtied since the last flush, so long copies can be written back in large ordered batches
+struct flush_batch_t
+{
+    uint8_t *address;
+    size_t low;
+    size_t high;
+    size_t dirty;
+};
+
+// Write the dirtied span back to the image file and start a new batch
+void flush_batch_sync(struct flush_batch_t *batch)
+{
+    if (batch->high > batch->low)
+    {
+        // msync needs a page aligned start
+        size_t page = sysconf(_SC_PAGESIZE);
+        size_t low = batch->low - batch->low % page;
+        if (msync(batch->address + low, batch->high - low, MS_SYNC) == -1)
+            perror("Error at msync");
+    }
+    batch->low = batch->high = batch->dirty = 0;
+}
+
+// Record that length bytes at offset were written, flushing once enough data has built up
+void flush_batch_add(struct flush_batch_t *batch, size_t offset, size_t length)
+{
+    if (batch->dirty == 0 || offset < batch->low)
+        batch->low = offset;
+    if (offset + length > batch->high)
+        batch->high = offset + length;
+    batch->dirty += length;
+    if (batch->dirty >= INGEST_FLUSH)
+        flush_batch_sync(batch);
+}
+
+// Size of the staged metadata updates after which they are committed without waiting for the end of the batch
+#define JOURNAL_LIMIT (1 << 20)
+
+// Metadata updates staged for the next commit, and the sidecar log they are written ahead to
+struct journal_t
+{
+    char path[PATH_MAX];
+    // Staged records, each an 8 byte image offset, a 4 byte length and the new bytes, all in network byte order
+    uint8_t *records;
+    size_t length;
+    size_t capacity;
+    uint32_t total_records;
+};
+
+// An open disk image: one shared mapping of the whole image plus the indexes parsed from it, which are built on first use and kept current by every command
+struct disk_t
+{
+    const char *path;
+    int fd;
+    uint8_t *address;
+    size_t size;
+    // A read-only image is mapped privately and never written back
+    bool writable;
+    // Bytes at the front of the image covered by the mapping; less than size only for a read-only image too large to map whole
+    size_t mapped;
+    struct superblock_t *sb;
+    const uint8_t *fat;
+    uint32_t block_count;
+    struct dir_index_t dir;
+    bool dir_loaded;
+    // Subdirectories parsed so far, below the root directory index
+    struct dentry_cache_t dentries;
+    struct free_index_t free;
+    bool free_loaded;
+    // Files that deduplicating puts may share blocks with, gathered from every directory on first use
+    struct dedup_index_t dedup;
+    bool dedup_loaded;
+    // Data written since the last commit, which must reach the image before the metadata that points at it
+    struct flush_batch_t batch;
+    struct journal_t journal;
+    // CRC32C of every block in network byte order, mapped from the table beside the image, or NULL if the image has none
+    uint32_t *sums;
+    uint8_t *sums_address;
+    size_t sums_size;
+    // Set when checksums changed since the table was last flushed
+    bool sums_dirty;
+    // Number of metadata updates replayed from the journal when the image was opened, or -1 if a torn journal was discarded
+    int recovered;
+};
+
+// Recompute the checksums of blocks in the mapping after they were written
+void disk_sums_update(struct disk_t *disk, uint32_t first, uint32_t count)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    if (disk->sums == NULL || first >= disk->block_count || ((size_t)first + count) * size > disk->mapped)
+        return;
+    if (count > disk->block_count - first)
+        count = disk->block_count - first;
+    crc32c_blocks(disk->address + (size_t)first * size, size, count, disk->sums + first);
+    for (uint32_t b = first; b < first + count; b++)
+        disk->sums[b] = htonl(disk->sums[b]);
+    disk->sums_dirty = true;
+}
+
+// Carry the checksums of blocks whose contents were copied elsewhere along with them
+void disk_sums_move(struct disk_t *disk, uint32_t to, uint32_t from, uint32_t count)
+{
+    if (disk->sums == NULL)
+        return;
+    memmove(disk->sums + to, disk->sums + from, (size_t)count * 4);
+    disk->sums_dirty = true;
+}
+
+// Make the checksums of everything written so far durable, which has to happen before the metadata pointing at those blocks is committed
+void disk_sums_flush(struct disk_t *disk)
+{
+    if (disk->sums_dirty == false)
+        return;
+    if (disk->writable == true && msync(disk->sums_address, disk->sums_size, MS_SYNC) == -1)
+        perror("Error at msync");
+    disk->sums_dirty = false;
+}
+
+// Check blocks read from the image against the checksum table; returns -1 after naming the first block that does not match
+int disk_sums_check(struct disk_t *disk, const uint8_t *data, uint32_t first, uint32_t count)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    uint32_t sums[256];
+    for (uint32_t done = 0; done < count && first + done < disk->block_count; done += 256)
+    {
+        uint32_t batch = count - done < 256 ? count - done : 256;
+        crc32c_blocks(data + (size_t)done * size, size, batch, sums);
+        for (uint32_t k = 0; k < batch; k++)
+            if (htonl(sums[k]) != disk->sums[first + done + k])
+            {
+                printf("Error: block %u of %s fails its checksum\n", first + done + k, disk->path);
+                return -1;
+            }
+    }
+    return 0;
+}
+
+// FNV-1a hash over a buffer, used to tell a complete journal from a torn one
+uint32_t journal_checksum(const uint8_t *data, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Apply a run of journal records to the mapping and flush them; returns the number applied, or -1 if a record is malformed
+int journal_apply(struct disk_t *disk, const uint8_t *records, size_t length)
+{
+    int applied = 0;
+    size_t i = 0;
+    while (i < length)
+    {
+        if (length - i < 12)
+            return -1;
+        uint32_t high, low, size;
+        memcpy(&high, records + i, 4);
+        memcpy(&low, records + i + 4, 4);
+        memcpy(&size, records + i + 8, 4);
+        uint64_t offset = (uint64_t)ntohl(high) << 32 | ntohl(low);
+        size = ntohl(size);
+        if (length - i - 12 < size || offset > disk->mapped || disk->mapped - offset < size)
+            return -1;
+        memcpy(disk->address + offset, records + i + 12, size);
+        // Keep the checksums of the blocks the record touched current, so a replay after a crash repairs them too
+        uint32_t block_size = ntohs(disk->sb->block_size);
+        if (size > 0)
+            disk_sums_update(disk, offset / block_size, (offset + size - 1) / block_size - offset / block_size + 1);
+        i += 12 + size;
+        applied++;
+    }
+
+    // Only the pages touched by the records are dirty, so flushing the whole mapping writes just those
+    if (disk->writable == true && msync(disk->address, disk->mapped, MS_SYNC) == -1)
+        perror("Error at msync");
+    disk_sums_flush(disk);
+    return applied;
+}
+
+// Replay a complete journal left behind by an interrupted commit, or discard a torn one; a read-only image only replays into its private mapping and leaves the journal for the next writer. Returns the number of updates replayed, or -1 if a journal was discarded
+int journal_recover(struct disk_t *disk)
+{
+    int jfd = open(disk->journal.path, O_RDONLY);
+    if (jfd == -1)
+        return 0;
+
+    struct stat buffer;
+    fstat(jfd, &buffer);
+    int replayed = 0;
+    if (buffer.st_size > 0)
+    {
+        uint8_t *log = malloc(buffer.st_size);
+        size_t length = pread(jfd, log, buffer.st_size, 0) == buffer.st_size ? buffer.st_size : 0;
+
+        // A journal is complete only if its header, records and trailing checksum all made it to disk
+        uint32_t payload, checksum;
+        if (length >= 20 && memcmp(log, "CSC360JL", 8) == 0)
+        {
+            memcpy(&payload, log + 12, 4);
+            payload = ntohl(payload);
+            memcpy(&checksum, log + length - 4, 4);
+            if (payload == length - 20 && ntohl(checksum) == journal_checksum(log, length - 4))
+                replayed = journal_apply(disk, log + 16, payload);
+        }
+        if (replayed > 0)
+            printf("Recovered %d metadata updates from %s\n", replayed, disk->journal.path);
+        else if (disk->writable == true)
+            printf("Discarded an incomplete journal at %s\n", disk->journal.path);
+        else
+            printf("Ignored an incomplete journal at %s\n", disk->journal.path);
+        free(log);
+    }
+    close(jfd);
+
+    // The image is consistent again, so the journal can go; replaying it twice would be harmless
+    if (disk->writable == true)
+        unlink(disk->journal.path);
+    return replayed > 0 ? replayed : buffer.st_size > 0 ? -1 : 0;
+}
+
+// Stage a metadata update for the next commit instead of writing it into the image straight away
+void journal_stage(struct disk_t *disk, size_t offset, const void *data, uint32_t length)
+{
+    struct journal_t *journal = &disk->journal;
+    if (journal->length + 12 + length > journal->capacity)
+    {
+        journal->capacity = journal->capacity == 0 ? 4096 : journal->capacity * 2;
+        while (journal->capacity < journal->length + 12 + length)
+            journal->capacity *= 2;
+        journal->records = realloc(journal->records, journal->capacity);
+    }
+
+    uint32_t high = htonl((uint64_t)offset >> 32), low = htonl(offset & 0xFFFFFFFF), size = htonl(length);
+    memcpy(journal->records + journal->length, &high, 4);
+    memcpy(journal->records + journal->length + 4, &low, 4);
+    memcpy(journal->records + journal->length + 8, &size, 4);
+    memcpy(journal->records + journal->length + 12, data, length);
+    journal->length += 12 + length;
+    journal->total_records++;
+}
+
+// Make every staged update durable in order: flush the new data, write the journal and sync it, apply the updates to the image, then empty the journal
+int disk_commit(struct disk_t *disk)
+{
+    struct journal_t *journal = &disk->journal;
+    flush_batch_sync(&disk->batch);
+    disk_sums_flush(disk);
+    if (journal->total_records == 0)
+        return 0;
+
+    // Frame the staged records with a header and a checksum so recovery can tell whether the write completed
+    size_t length = 16 + journal->length + 4;
+    uint8_t *log = malloc(length);
+    uint32_t total = htonl(journal->total_records), payload = htonl(journal->length);
+    memcpy(log, "CSC360JL", 8);
+    memcpy(log + 8, &total, 4);
+    memcpy(log + 12, &payload, 4);
+    memcpy(log + 16, journal->records, journal->length);
+    uint32_t checksum = htonl(journal_checksum(log, length - 4));
+    memcpy(log + length - 4, &checksum, 4);
+
+    int jfd = open(journal->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (jfd == -1 || pwrite(jfd, log, length, 0) != (ssize_t)length || fdatasync(jfd) == -1)
+    {
+        perror("Error at journal");
+        free(log);
+        if (jfd != -1)
+            close(jfd);
+        return -1;
+    }
+    free(log);
+
+    journal_apply(disk, journal->records, journal->length);
+    journal->length = 0;
+    journal->total_records = 0;
+
+    close(jfd);
+    unlink(journal->path);
+    return 0;
+}
+
+// Map a read-only image privately; the metadata every command reads is populated up front, and when the whole image does not fit in the address space only that metadata is mapped and the rest is read with pread. Returns -1 if not even the metadata can be mapped
+int disk_map_read_only(struct disk_t *disk)
+{
+    // Find where the metadata ends before anything is mapped
+    struct superblock_t sb;
+    if (pread(disk->fd, &sb, sizeof(sb), 0) != sizeof(sb))
+    {
+        perror("Error at pread");
+        return -1;
+    }
+    uint64_t fat_end = ((uint64_t)ntohl(sb.fat_start_block) + ntohl(sb.fat_block_count)) * ntohs(sb.block_size);
+    uint64_t root_end = ((uint64_t)ntohl(sb.root_dir_start_block) + ntohl(sb.root_dir_block_count)) * ntohs(sb.block_size);
+    size_t metadata = fat_end > root_end ? fat_end : root_end;
+    if (metadata > disk->size || metadata < sizeof(sb))
+        metadata = disk->size;
+
+    // Pages of a private mapping are only copied if something writes them, which only a pending journal's replay does
+    int prot = PROT_READ | (access(disk->journal.path, F_OK) == 0 ? PROT_WRITE : 0);
+    disk->address = mmap(NULL, disk->size, prot, MAP_PRIVATE, disk->fd, 0);
+    if (disk->address != (void *)-1)
+    {
+        disk->mapped = disk->size;
+        mmap(disk->address, metadata, prot, MAP_PRIVATE | MAP_FIXED | MAP_POPULATE, disk->fd, 0);
+        return 0;
+    }
+    if (errno != ENOMEM)
+    {
+        perror("Error at address");
+        return -1;
+    }
+
+    disk->address = mmap(NULL, metadata, prot, MAP_PRIVATE | MAP_POPULATE, disk->fd, 0);
+    if (disk->address == (void *)-1)
+    {
+        perror("Error at address");
+        return -1;
+    }
+    disk->mapped = metadata;
+    return 0;
+}
+
+// Map the checksum table kept in <image>.crc if there is one that matches the image; an image without one is simply not checked. A read-only image maps it privately, so replaying a journal can still update it in memory
+void disk_sums_open(struct disk_t *disk)
+{
+    crc32c_init();
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s.crc", disk->path);
+    int fd = open(path, disk->writable == true ? O_RDWR : O_RDONLY);
+    if (fd == -1)
+        return;
+
+    // The table is a 16 byte header naming the geometry it covers, followed by one checksum per block
+    struct stat buffer;
+    fstat(fd, &buffer);
+    size_t expected = 16 + (size_t)disk->block_count * 4;
+    uint8_t *address = (size_t)buffer.st_size == expected ? mmap(NULL, expected, PROT_READ | PROT_WRITE, disk->writable == true ? MAP_SHARED : MAP_PRIVATE, fd, 0) : (void *)-1;
+    close(fd);
+    uint32_t header[2] = {htonl(ntohs(disk->sb->block_size)), htonl(disk->block_count)};
+    if (address == (void *)-1 || memcmp(address, "CSC360CK", 8) != 0 || memcmp(address + 8, header, 8) != 0)
+    {
+        printf("Ignored %s, which does not match the image\n", path);
+        if (address != (void *)-1)
+            munmap(address, expected);
+        return;
+    }
+    disk->sums_address = address;
+    disk->sums_size = expected;
+    disk->sums = (uint32_t *)(address + 16);
+}
+
+// Open and map the disk image, for reading and writing or read-only; returns -1 if the image cannot be used
+int disk_open(struct disk_t *disk, const char *path, bool writable)
+{
+    memset(disk, 0, sizeof(*disk));
+    disk->path = path;
+    disk->writable = writable;
+    snprintf(disk->journal.path, sizeof(disk->journal.path), "%s.journal", path);
+
+    // Open the disk image for reading and writing, or only for reading so read-only media and concurrent readers work
+    disk->fd = open(path, writable == true ? O_RDWR : O_RDONLY);
+    if (disk->fd == -1)
+    {
+        perror("Error at fd");
+        return -1;
+    }
+
+    // Return information about the disk image
+    struct stat buffer;
+    fstat(disk->fd, &buffer);
+    disk->size = buffer.st_size;
+    if (disk->size < sizeof(struct superblock_t))
+    {
+        printf("Error: %s is not a disk image\n", path);
+        close(disk->fd);
+        return -1;
+    }
+
+    // Create a new mapping in the virtual address space
+    if (writable == true)
+    {
+        disk->address = mmap(NULL, disk->size, PROT_READ | PROT_WRITE, MAP_SHARED, disk->fd, 0);
+        if (disk->address == (void *)-1)
+            perror("Error at address");
+        disk->mapped = disk->size;
+    }
+    else if (disk_map_read_only(disk) == -1)
+        disk->address = (void *)-1;
+    if (disk->address == (void *)-1)
+    {
+        close(disk->fd);
+        return -1;
+    }
+
+    // Initialize a new super block structure with the mapping of the address space
+    disk->sb = (struct superblock_t *)disk->address;
+    disk->fat = disk->address + (size_t)ntohl(disk->sb->fat_start_block) * ntohs(disk->sb->block_size);
+    disk->block_count = image_block_count(disk->address, disk->size);
+    disk->batch.address = disk->address;
+    disk_sums_open(disk);
+
+    // Finish or roll back any commit that was interrupted before the image is used
+    disk->recovered = journal_recover(disk);
+    return 0;
+}
+
+// Gather the slots of a directory's extents; a directory reaching beyond the mapping is read whole into a private copy returned through copy, which is NULL otherwise and freed by the caller
+int disk_dir_slots(struct disk_t *disk, const struct extent_t *extents, int total_extents, struct dir_entry_t ***slots, uint8_t **copy)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    bool mapped = true;
+    for (int e = 0; e < total_extents && disk->mapped < disk->size; e++)
+        mapped = mapped && ((uint64_t)extents[e].start + extents[e].length) * size <= disk->mapped;
+    *copy = NULL;
+    if (mapped == true)
+        return dir_slots(disk->address, disk->mapped, extents, total_extents, slots);
+
+    // Read the extents back to back into one buffer, stopping at the end of the image
+    size_t total_bytes = 0, copied = 0;
+    for (int e = 0; e < total_extents; e++)
+        total_bytes += (size_t)extents[e].length * size;
+    *copy = malloc(total_bytes + 1);
+    for (int e = 0; e < total_extents; e++)
+    {
+        size_t want = (size_t)extents[e].length * size;
+        ssize_t got = pread(disk->fd, *copy + copied, want, (off_t)extents[e].start * size);
+        if (got <= 0)
+            break;
+        copied += got;
+        if ((size_t)got < want)
+            break;
+    }
+
+    int total_slots = copied / sizeof(struct dir_entry_t);
+    *slots = malloc((total_slots + 1) * sizeof(**slots));
+    for (int i = 0; i < total_slots; i++)
+        (*slots)[i] = (struct dir_entry_t *)*copy + i;
+    return total_slots;
+}
+
+// Return the root directory index, parsing the directory the first time it is needed
+struct dir_index_t *disk_dir(struct disk_t *disk)
+{
+    if (disk->dir_loaded == false)
+    {
+        // The root directory is the contiguous extent named by the super block
+        struct extent_t root = {ntohl(disk->sb->root_dir_start_block), ntohl(disk->sb->root_dir_block_count)};
+        struct dir_entry_t **slots;
+        uint8_t *copy;
+        int total_slots = disk_dir_slots(disk, &root, 1, &slots, &copy);
+        dir_index_build(&disk->dir, root.start, slots, total_slots, copy);
+        disk->dir_loaded = true;
+    }
+    return &disk->dir;
+}
+
+// Return the index of the subdirectory name of parent, parsing it through its FAT chain and caching it the first time it is needed; returns NULL if there is no such directory
+struct dir_index_t *disk_subdir(struct disk_t *disk, struct dir_index_t *parent, const char *name)
+{
+    struct dir_index_t *dir = dentry_find(&disk->dentries, parent->start, name);
+    if (dir != NULL)
+        return dir;
+
+    // Only entries with the directory bit set can be descended into
+    struct dir_entry_t *entry = dir_index_find(parent, name);
+    if (entry == NULL || (entry->status & 0x04) == 0)
+        return NULL;
+
+    // The walk stops after the blocks the entry claims, so a broken or cyclic directory chain is never followed further
+    struct chain_t chain;
+    chain_resolve(disk->fat, disk->block_count, ntohl(entry->starting_block), ntohl(entry->block_count), &chain);
+    struct dir_entry_t **slots;
+    uint8_t *copy;
+    int total_slots = disk_dir_slots(disk, chain.extents, chain.total_extents, &slots, &copy);
+    chain_destroy(&chain);
+    dir = malloc(sizeof(*dir));
+    dir_index_build(dir, ntohl(entry->starting_block), slots, total_slots, copy);
+
+    dentry_add(&disk->dentries, parent->start, name, dir);
+    return dir;
+}
+
+// Walk every directory along a path relative to the root, returning the directory that holds its last component and copying that component into leaf; returns NULL if a directory along the way does not exist
+struct dir_index_t *disk_resolve(struct disk_t *disk, const char *path, char leaf[sizeof(((struct dir_entry_t *)0)->filename) + 1])
+{
+    struct dir_index_t *dir = disk_dir(disk);
+    while (true)
+    {
+        // Skip the "/" characters in front of the next component, which is cut to the length of the filename field
+        path += strspn(path, "/");
+        size_t length = strcspn(path, "/");
+        size_t kept = length < sizeof(((struct dir_entry_t *)0)->filename) ? length : sizeof(((struct dir_entry_t *)0)->filename);
+        memcpy(leaf, path, kept);
+        leaf[kept] = '\0';
+        path += length;
+
+        // The last component, with or without a trailing "/", is left for the caller
+        if (path[strspn(path, "/")] == '\0')
+            return dir;
+        dir = disk_subdir(disk, dir, leaf);
+        if (dir == NULL)
+            return NULL;
+    }
+}
+
+// Return the index of the directory at a path relative to the root, or NULL if there is no such directory
+struct dir_index_t *disk_lookup_dir(struct disk_t *disk, const char *path)
+{
+    char leaf[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+    struct dir_index_t *parent = disk_resolve(disk, path, leaf);
+    if (parent == NULL || leaf[0] == '\0')
+        return parent;
+    return disk_subdir(disk, parent, leaf);
+}
+
+// Return the free space index, scanning the FAT the first time it is needed
+struct free_index_t *disk_free(struct disk_t *disk)
+{
+    if (disk->free_loaded == false)
+    {
+        free_index_build(&disk->free, disk->address, disk->size);
+        disk->free_loaded = true;
+    }
+    return &disk->free;
+}
+
+// Return the index of files by size, walking every directory the first time it is needed; a directory reached twice is only read once
+struct dedup_index_t *disk_dedup(struct disk_t *disk)
+{
+    if (disk->dedup_loaded == true)
+        return &disk->dedup;
+    disk->dedup_loaded = true;
+
+    uint8_t *visited = calloc(disk->block_count / 8 + 1, 1);
+    int capacity = 64, total_dirs = 1;
+    struct dir_index_t **dirs = malloc(capacity * sizeof(*dirs));
+    dirs[0] = disk_dir(disk);
+    for (int d = 0; d < total_dirs; d++)
+    {
+        struct dir_index_t *dir = dirs[d];
+        for (int i = 0; i < dir->total_entries; i++)
+        {
+            struct dir_entry_t *entry = dir->entries[i];
+            uint32_t first = ntohl(entry->starting_block);
+            if ((entry->status & 0x01) == 0 || first >= disk->block_count)
+                continue;
+            if ((entry->status & 0x04) == 0)
+            {
+                // Only files with blocks are worth sharing
+                if (entry->size != 0)
+                    dedup_add(&disk->dedup, ntohl(entry->size), first, 0, false);
+                continue;
+            }
+            if ((visited[first / 8] & 1 << (first % 8)) != 0)
+                continue;
+            visited[first / 8] |= 1 << (first % 8);
+            struct dir_index_t *subdir = disk_subdir(disk, dir, dir->names[i]);
+            if (subdir == NULL)
+                continue;
+            if (total_dirs == capacity)
+            {
+                capacity *= 2;
+                dirs = realloc(dirs, capacity * sizeof(*dirs));
+            }
+            dirs[total_dirs++] = subdir;
+        }
+    }
+    free(dirs);
+    free(visited);
+    return &disk->dedup;
+}
+
+// Digest a file's chain the same way a local file is digested, block by block over the bytes it uses; sets broken if the chain does not hold the file
+uint64_t disk_chain_digest(struct disk_t *disk, uint32_t start, uint32_t file_size, bool *broken)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    uint32_t need = file_size / size + (file_size % size != 0);
+    uint64_t digest = 0;
+    uint32_t offset = 0;
+    struct chain_walk_t walk;
+    chain_walk_begin(&walk, disk->fat, disk->block_count, start, need);
+    uint32_t block;
+    while (chain_walk_next(&walk, &block) == true)
+    {
+        uint32_t length = file_size - offset < size ? file_size - offset : size;
+        digest = block_hash(disk->address + (size_t)block * size, length, digest);
+        offset += length;
+    }
+    *broken = walk.end != CHAIN_END || offset != file_size;
+    return digest;
+}
+
+// Find a file in the image whose contents are the given bytes, comparing every byte of any file whose size and digest match; returns its first block, or 0xFFFFFFFF if there is none
+uint32_t disk_dedup_match(struct disk_t *disk, const uint8_t *data, uint32_t file_size, uint64_t digest)
+{
+    struct dedup_index_t *index = disk_dedup(disk);
+    if (index->total_files == 0)
+        return 0xFFFFFFFF;
+    uint32_t size = ntohs(disk->sb->block_size);
+
+    uint32_t bucket = file_size * 2654435761u & (index->total_buckets - 1);
+    for (int i = index->buckets[bucket]; i != -1; i = index->files[i].next)
+    {
+        struct dedup_file_t *file = &index->files[i];
+        if (file->size != file_size || file->broken == true || (file->hashed == true && file->digest != digest))
+            continue;
+
+        // A candidate put earlier in this session is only linked once its staged updates are committed
+        if (disk->journal.total_records > 0 && disk_commit(disk) == -1)
+            return 0xFFFFFFFF;
+        if (file->hashed == false)
+        {
+            file->digest = disk_chain_digest(disk, file->start, file_size, &file->broken);
+            file->hashed = true;
+            if (file->broken == true || file->digest != digest)
+                continue;
+        }
+
+        // Equal digests are only a hint; the bytes decide
+        uint32_t offset = 0;
+        struct chain_walk_t walk;
+        chain_walk_begin(&walk, disk->fat, disk->block_count, file->start, file_size / size + (file_size % size != 0));
+        uint32_t block;
+        while (chain_walk_next(&walk, &block) == true)
+        {
+            uint32_t length = file_size - offset < size ? file_size - offset : size;
+            if (memcmp(disk->address + (size_t)block * size, data + offset, length) != 0)
+                break;
+            offset += length;
+        }
+        if (offset == file_size && walk.end == CHAIN_END)
+            return file->start;
+    }
+    return 0xFFFFFFFF;
+}
+
+// Drop the indexes parsed from the image after the FAT or directories changed underneath them
+void disk_invalidate(struct disk_t *disk)
+{
+    if (disk->free_loaded == true)
+        free_index_destroy(&disk->free);
+    if (disk->dir_loaded == true)
+        dir_index_destroy(&disk->dir);
+    dentry_cache_destroy(&disk->dentries);
+    if (disk->dedup_loaded == true)
+        dedup_destroy(&disk->dedup);
+    disk->free_loaded = disk->dir_loaded = disk->dedup_loaded = false;
+}
+
+// Commit any staged updates, release the indexes, delete the mapping and close the image
+void disk_close(struct disk_t *disk)
+{
+    if (disk_commit(disk) == -1)
+        printf("Error: staged updates to %s were not committed\n", disk->path);
+    free(disk->journal.records);
+    disk_invalidate(disk);
+    if (disk->sums != NULL)
+        munmap(disk->sums_address, disk->sums_size);
+    munmap(disk->address, disk->mapped);
+    close(disk->fd);
+}
+
+// Print the super block and a census of the FAT
+void disk_info(struct disk_t *disk)
+{
+    struct superblock_t *sb = disk->sb;
+
+    // Initialize the start and end location variables to their corresponding values in the FAT table
+    size_t start = (size_t)ntohl(sb->fat_start_block) * htons(sb->block_size);
+    size_t end = (size_t)ntohl(sb->fat_block_count) * htons(sb->block_size);
+    // Never read past the end of the image, even if the super block claims a larger FAT
+    if (start + end > disk->mapped)
+        end = start < disk->mapped ? disk->mapped - start : 0;
+
+    // Count the free, reserved and allocated blocks across the whole FAT
+    struct fat_census_t census;
+    fat_census(disk->address + start, end / 4, &census);
+
+    // Print the appropriate super block information
+    printf("Super block information:\n");
+    printf("Block size: %d\n", htons(sb->block_size));
+    printf("Block count: %d\n", ntohl(sb->file_system_block_count));
+    printf("FAT starts: %d\n", ntohl(sb->fat_start_block));
+    printf("FAT blocks: %d\n", ntohl(sb->fat_block_count));
+    printf("Root directory start: %d\n", ntohl(sb->root_dir_start_block));
+    printf("Root directory blocks: %d\n\n", ntohl(sb->root_dir_block_count));
+
+    // Print the appropriate FAT information
+    printf("FAT information:\n");
+    printf("Free Blocks: %llu\n", (unsigned long long)census.free);
+    printf("Reserved Blocks: %llu\n", (unsigned long long)census.reserved);
+    printf("Allocated Blocks: %llu\n", (unsigned long long)census.allocated);
+}
+
+// Print a single directory entry
+void list_entry(struct dir_entry_t *rb)
+{
+    // If the size of the rootblock is 0, skip the entry entirely
+    if (ntohl(rb->size) == 0)
+        return;
+    // Print the correct information pertaining to the disk image
+    printf("%c %10d %30s %4d/%02d/%02d %02d:%02d:%02d\n", rb->status == 3 ? 'F' : 'D', ntohl(rb->size), rb->filename, htons(rb->modify_time.year),
+           rb->modify_time.month, rb->modify_time.day, rb->modify_time.hour, rb->modify_time.minute, rb->modify_time.second);
+}
+
+// Print a directory under its path, then every directory below it depth first; each subdirectory is read straight from its chain and dropped once listed, so output streams with memory bounded by the depth of the tree
+void list_tree(struct disk_t *disk, char path[PATH_MAX], size_t length, uint32_t ancestors[PATH_MAX / 2], int depth, struct dir_entry_t **slots, int total_slots)
+{
+    printf("%s:\n", length == 0 ? "/" : path);
+    for (int i = 0; i < total_slots; i++)
+        list_entry(slots[i]);
+
+    for (int i = 0; i < total_slots; i++)
+    {
+        struct dir_entry_t *rb = slots[i];
+        if ((rb->status & 0x05) != 0x05)
+            continue;
+
+        char name[sizeof(rb->filename) + 1];
+        memcpy(name, rb->filename, sizeof(rb->filename));
+        name[sizeof(rb->filename)] = '\0';
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+            continue;
+        // Never descend into a directory that is already being listed further up, or past the longest path
+        bool cycle = false;
+        for (int a = 0; a < depth; a++)
+            cycle = cycle || ancestors[a] == ntohl(rb->starting_block);
+        if (cycle == true)
+        {
+            printf("Error: %s/%s refers back to a directory above it\n", path, name);
+            continue;
+        }
+        size_t child = length + 1 + strlen(name);
+        if (child >= PATH_MAX)
+        {
+            printf("Error: %s/%s is nested too deeply\n", path, name);
+            continue;
+        }
+        path[length] = '/';
+        memcpy(path + length + 1, name, strlen(name) + 1);
+
+        // The walk stops after the blocks the entry claims, so a broken or cyclic directory chain is never followed further
+        struct chain_t chain;
+        chain_resolve(disk->fat, disk->block_count, ntohl(rb->starting_block), ntohl(rb->block_count), &chain);
+        struct dir_entry_t **child_slots;
+        uint8_t *copy;
+        int total_child_slots = disk_dir_slots(disk, chain.extents, chain.total_extents, &child_slots, &copy);
+        chain_destroy(&chain);
+
+        printf("\n");
+        ancestors[depth] = ntohl(rb->starting_block);
+        list_tree(disk, path, child, ancestors, depth + 1, child_slots, total_child_slots);
+        free(child_slots);
+        free(copy);
+        path[length] = '\0';
+    }
+}
+
+// Print every entry of the directory at a path relative to the root, and with recursive every directory below it; returns -1 if there is no such directory
+int disk_list(struct disk_t *disk, const char *path, bool recursive)
+{
+    struct dir_index_t *dir = disk_lookup_dir(disk, path);
+    if (dir == NULL)
+    {
+        printf("Error: directory not found\n");
+        return -1;
+    }
+
+    if (recursive == false)
+    {
+        // Loop over every slot of the directory
+        for (int i = 0; i < dir->total_entries; i++)
+            list_entry(dir->entries[i]);
+        return 0;
+    }
+
+    // Head the listing with the path as given, without its leading or trailing "/" characters
+    char tree[PATH_MAX];
+    path += strspn(path, "/");
+    size_t length = strlen(path);
+    while (length > 0 && path[length - 1] == '/')
+        length--;
+    if (length + 1 >= PATH_MAX)
+        length = PATH_MAX - 2;
+    tree[0] = '/';
+    memcpy(tree + 1, path, length);
+    tree[length + 1] = '\0';
+    uint32_t ancestors[PATH_MAX / 2] = {dir->start};
+    list_tree(disk, tree, length == 0 ? 0 : length + 1, ancestors, 1, dir->entries, dir->total_entries);
+    return 0;
+}
+
+// Amount of upcoming file data the extractor asks the kernel to read ahead
+#define EXTRACT_READAHEAD (16 << 20)
+
+// Tune the mapping for copying files out: data is read in order, and a read-only mapping can also be backed by huge pages
+void disk_advise_copy(struct disk_t *disk)
+{
+    madvise(disk->address, disk->mapped, MADV_SEQUENTIAL);
+    if (disk->writable == false)
+        madvise(disk->address, disk->mapped, MADV_HUGEPAGE);
+}
+
+// Copy a run of the image that lies beyond the mapping to out through a bounce buffer; returns -1 if it could not be read or written
+int copy_unmapped(int out, struct disk_t *disk, size_t offset, size_t length)
+{
+    // Whole blocks are read so each one can be checked against the checksum table before it is written out
+    uint32_t size = ntohs(disk->sb->block_size);
+    size_t chunk = INGEST_CHUNK - INGEST_CHUNK % size;
+    size_t blocks = (length + size - 1) / size * size;
+    if (blocks < chunk)
+        chunk = blocks;
+    uint8_t *buffer = malloc(chunk > 0 ? chunk : 1);
+    int result = 0;
+    while (length > 0)
+    {
+        size_t want = (length + size - 1) / size * size;
+        ssize_t got = pread(disk->fd, buffer, want < chunk ? want : chunk, offset);
+        if (got <= 0)
+        {
+            perror("Error at pread");
+            result = -1;
+            break;
+        }
+        if (disk->sums != NULL && disk_sums_check(disk, buffer, offset / size, got / size) == -1)
+        {
+            result = -1;
+            break;
+        }
+        size_t used = (size_t)got < length ? (size_t)got : length;
+        if (write_all(out, buffer, used) == -1)
+        {
+            perror("Error at write");
+            result = -1;
+            break;
+        }
+        offset += used;
+        length -= used;
+    }
+    free(buffer);
+    return result;
+}
+
+// Copy a file out of the image: resolve its chain into extents in one bounded pass, then write each extent with a single write while the next ones are read ahead. Returns -1 if the chain is shorter than the file, -2 if a block failed its checksum or could not be copied
+int extract_chain(int out, struct disk_t *disk, uint32_t block, uint32_t file_size)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    uint32_t need = file_size / size + (file_size % size != 0);
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    // The walk stops after the blocks the file needs, so a chain that is too long or cyclic is never followed further
+    struct chain_t chain;
+    chain_resolve(disk->fat, disk->block_count, block, need, &chain);
+
+    size_t remaining = file_size;
+    size_t ahead = 0;
+    int prefetched = 0;
+    int result = chain.total_blocks < need ? -1 : 0;
+    for (int e = 0; e < chain.total_extents && remaining > 0; e++)
+    {
+        // Keep a window of upcoming extents in flight, since a fragmented file defeats the kernel's own read ahead
+        while (prefetched < chain.total_extents && ahead < EXTRACT_READAHEAD)
+        {
+            size_t offset = (size_t)chain.extents[prefetched].start * size;
+            size_t length = (size_t)chain.extents[prefetched].length * size;
+            if (offset + length <= disk->mapped)
+                madvise(disk->address + offset - offset % page, length + offset % page, MADV_WILLNEED);
+            else
+                posix_fadvise(disk->fd, offset, length, POSIX_FADV_WILLNEED);
+            ahead += length;
+            prefetched++;
+        }
+
+        // The final block of the file is only partially used
+        size_t offset = (size_t)chain.extents[e].start * size;
+        size_t run_bytes = (size_t)chain.extents[e].length * size;
+        ahead -= run_bytes;
+        if (run_bytes > remaining)
+            run_bytes = remaining;
+
+        // Data past the end of the mapping is read with pread instead; either way every block is checked before it is written out
+        int copied;
+        uint32_t run_blocks = (run_bytes + size - 1) / size;
+        if (offset + (size_t)run_blocks * size > disk->mapped)
+            copied = copy_unmapped(out, disk, offset, run_bytes);
+        else if (disk->sums != NULL && disk_sums_check(disk, disk->address + offset, chain.extents[e].start, run_blocks) == -1)
+            copied = -1;
+        else if ((copied = write_all(out, disk->address + offset, run_bytes)) == -1)
+            perror("Error at write");
+        if (copied == -1)
+        {
+            result = -2;
+            break;
+        }
+        remaining -= run_bytes;
+    }
+
+    chain_destroy(&chain);
+    return result;
+}
+
+// Copy the file at file_name, a path relative to the root, out of the image into the local file; returns -1 if it could not be found or copied
+int disk_get(struct disk_t *disk, const char *file_name, const char *local)
+{
+    // Look the file up through the cached directories along its path and its own directory's hash table
+    char leaf[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+    struct dir_index_t *dir = disk_resolve(disk, file_name, leaf);
+    struct dir_entry_t *entry = dir == NULL ? NULL : dir_index_find(dir, leaf);
+    if (entry == NULL || (entry->status & 0x02) == 0)
+    {
+        printf("Error: file not found\n");
+        return -1;
+    }
+
+    // Open the appopriate file on the user's local machine in writing mode
+    int out = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+        perror("Error at out");
+        return -1;
+    }
+
+    // Hint to the kernel that the data blocks will be read in order, in pages as large as it can manage
+    disk_advise_copy(disk);
+
+    int result = extract_chain(out, disk, ntohl(entry->starting_block), ntohl(entry->size));
+    close(out);
+    if (result == -1)
+        printf("Error: %s is truncated in %s\n", file_name, disk->path);
+    if (result != 0)
+        return -1;
+
+    printf("Success: found %s in %s\n", file_name, disk->path);
+    return 0;
+}
+
+// Read up to length bytes of the local file straight into the image in large chunks; returns the number of bytes read
+size_t ingest_run(int in, struct flush_batch_t *batch, size_t offset, size_t length)
+{
+    size_t total = 0;
+    while (total < length)
+    {
+        size_t chunk = length - total < INGEST_CHUNK ? length - total : INGEST_CHUNK;
+        ssize_t got = read(in, batch->address + offset + total, chunk);
+        if (got == -1 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            break;
+        flush_batch_add(batch, offset + total, got);
+        total += got;
+    }
+    return total;
+}
+
+// Copy the local file into the image as the root directory file file_name; returns -1 if it could not be placed
+int disk_put(struct disk_t *disk, const char *local, const char *file_name, bool dedup)
+{
+    // Open the local file once, streaming it straight into the image without any intermediate buffer
+    int f_tu = open(local, O_RDONLY);
+    if (f_tu == -1)
+    {
+        printf("Error: file not found\n");
+        return -1;
+    }
+    posix_fadvise(f_tu, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    struct stat buffer_tu;
+    fstat(f_tu, &buffer_tu);
+    // The directory entry stores the size in 32 bits
+    if ((uint64_t)buffer_tu.st_size > UINT32_MAX)
+    {
+        printf("Error: %s is too large for %s\n", local, disk->path);
+        close(f_tu);
+        return -1;
+    }
+    uint32_t file_size = buffer_tu.st_size;
+
+    uint8_t *address = disk->address;
+    uint32_t size = htons(disk->sb->block_size);
+    size_t start = (size_t)ntohl(disk->sb->fat_start_block) * size;
+
+    // Create a variable declaring the needed file size by computing a modulo operation on the remnant value, and incrementing appropriately
+    uint32_t need = file_size / size;
+    file_size % size != 0 ? need++ : need;
+
+    // Reject a name that is already taken, and make sure a directory slot is free before any data is written
+    char leaf[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+    struct dir_index_t *dir = disk_resolve(disk, file_name, leaf);
+    int result = 0;
+    if (dir == NULL)
+    {
+        printf("Error: directory of /%s not found in %s\n", file_name, disk->path);
+        result = -1;
+    }
+    else if (leaf[0] == '\0')
+    {
+        printf("Error: /%s is not a file name\n", file_name);
+        result = -1;
+    }
+    else if (dir_index_find(dir, leaf) != NULL)
+    {
+        printf("Error: /%s already exists in %s\n", file_name, disk->path);
+        result = -1;
+    }
+    else if (dir->total_free == 0)
+    {
+        printf("Error: no free directory entry in %s\n", disk->path);
+        result = -1;
+    }
+
+    // A deduplicating put first looks for a file with the same bytes, and shares its chain instead of writing any data
+    uint32_t shared = 0xFFFFFFFF;
+    uint64_t digest = 0;
+    bool hashed = false;
+    if (result == 0 && dedup == true && file_size > 0)
+    {
+        uint8_t *data = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, f_tu, 0);
+        if (data != (void *)-1)
+        {
+            for (uint32_t offset = 0; offset < file_size; offset += size)
+                digest = block_hash(data + offset, file_size - offset < size ? file_size - offset : size, digest);
+            hashed = true;
+            shared = disk_dedup_match(disk, data, file_size, digest);
+            munmap(data, file_size);
+        }
+    }
+
+    // Claim the fewest, largest runs of free blocks that hold the file
+    struct extent_t *extents = NULL;
+    int total_extents = result == -1 ? -1 : shared != 0xFFFFFFFF ? 0 : free_index_alloc(disk_free(disk), need, &extents);
+    if (result == 0 && total_extents == -1)
+    {
+        printf("Error: not enough free space in %s\n", disk->path);
+        result = -1;
+    }
+    if (result == -1)
+    {
+        close(f_tu);
+        return -1;
+    }
+
+    uint32_t starting_idx = shared != 0xFFFFFFFF ? shared : total_extents > 0 ? extents[0].start : 0xFFFFFFFF;
+    // Later deduplicating puts may share the new chain as well
+    if (disk->dedup_loaded == true && shared == 0xFFFFFFFF && file_size > 0)
+        dedup_add(&disk->dedup, file_size, starting_idx, digest, hashed);
+    for (int e = 0; e < total_extents; e++)
+    {
+        // Read this run of the local file straight into its blocks, zeroing whatever the file does not fill
+        size_t offset = (size_t)extents[e].start * size;
+        size_t run_bytes = (size_t)extents[e].length * size;
+        size_t read = ingest_run(f_tu, &disk->batch, offset, run_bytes);
+        memset(address + offset + read, 0, run_bytes - read);
+        flush_batch_add(&disk->batch, offset + read, run_bytes - read);
+        disk_sums_update(disk, extents[e].start, extents[e].length);
+
+        // Link each block of the run to its successor, and the run's last block to the next run or the end of the chain
+        uint32_t *links = malloc((size_t)extents[e].length * 4);
+        for (uint32_t b = 0; b < extents[e].length; b++)
+        {
+            uint32_t next = b + 1 < extents[e].length ? extents[e].start + b + 1 : e + 1 < total_extents ? extents[e + 1].start
+                                                                                                           : 0xFFFFFFFF;
+            links[b] = htonl(next);
+        }
+        // The run's FAT entries are contiguous, so they are staged as a single update
+        journal_stage(disk, start + (size_t)extents[e].start * 4, links, extents[e].length * 4);
+        free(links);
+    }
+    free(extents);
+
+    // Set the status of the file added to the disk image as "F"
+    int status = 3;
+    // Build the entry for a newly claimed directory slot, to be staged once it is complete
+    size_t slot = (uint8_t *)dir_index_insert(dir, leaf) - address;
+    uint8_t entry[sizeof(struct dir_entry_t)] = {0};
+    // The name field is fixed width and needs no terminator, so a name that fills it is copied without one
+    memcpy(entry + 27, leaf, strnlen(leaf, sizeof(((struct dir_entry_t *)0)->filename)));
+
+    // Get the value of the local time zone
+    time_t rawtime;
+    time(&rawtime);
+    // From time.h create a structure used to hold the time and date
+    struct tm *info = localtime(&rawtime);
+
+    // Create a buffer that holds the time information
+    char buffer_time[10];
+    int time;
+
+    // Set the added file in the disk image as "F" for the type
+    memcpy(entry, &status, 1);
+
+    // Set the attributes for the file added in the disk image
+    starting_idx = ntohl(starting_idx);
+    memcpy(entry + 1, &starting_idx, 4);
+
+    uint32_t block_count = htonl(need);
+    memcpy(entry + 5, &block_count, 4);
+
+    file_size = htonl(file_size);
+    memcpy(entry + 9, &file_size, 4);
+
+    // Get the current year
+    strftime(buffer_time, sizeof(buffer_time), "%Y", info);
+    sscanf(buffer_time, "%d", &time);
+    // Convert the unsigned short interger to a network byte
+    time = htons(time);
+    memcpy(entry + 20, &time, 2);
+
+    // Get the current month
+    strftime(buffer_time, sizeof(buffer_time), "%m", info);
+    sscanf(buffer_time, "%d", &time);
+    memcpy(entry + 22, &time, 1);
+
+    // Get the current day
+    strftime(buffer_time, sizeof(buffer_time), "%d", info);
+    sscanf(buffer_time, "%d", &time);
+    memcpy(entry + 23, &time, 1);
+
+    // Get the current hour
+    strftime(buffer_time, sizeof(buffer_time), "%H", info);
+    sscanf(buffer_time, "%d", &time);
+    memcpy(entry + 24, &time, 1);
+
+    // Get the current month
+    strftime(buffer_time, sizeof(buffer_time), "%M", info);
+    sscanf(buffer_time, "%d", &time);
+    memcpy(entry + 25, &time, 1);
+
+    // Get the current seconds
+    strftime(buffer_time, sizeof(buffer_time), "%S", info);
+    sscanf(buffer_time, "%d", &time);
+    memcpy(entry + 26, &time, 1);
+
+    // Stage the directory entry after the FAT updates so a replay links the chain before publishing the file
+    journal_stage(disk, slot, entry, sizeof(entry));
+
+    // Let a run of small puts share one commit, but never let the staged updates grow without bound
+    if (disk->journal.length >= JOURNAL_LIMIT && disk_commit(disk) == -1)
+    {
+        close(f_tu);
+        return -1;
+    }
+
+    // Notify the user of what the file was placed as in the disk image
+    if (shared != 0xFFFFFFFF)
+        printf("Success: placed %s as %s in %s, sharing the blocks of an identical file\n", local, file_name, disk->path);
+    else
+        printf("Success: placed %s as %s in %s\n", local, file_name, disk->path);
+
+    close(f_tu);
+    return 0;
+}
+
+// A single file queued for extraction by the batch worker pool
+struct extract_job_t
+{
+    struct dir_entry_t *entry;
+    // Directory part of the pattern that matched the file, which the file's name follows in messages
+    const char *directory;
+    int directory_length;
+    char path[PATH_MAX];
+    int result;
+};
+
+// State shared by every worker of the batch extractor, including the one view of the image
+struct extract_pool_t
+{
+    struct disk_t *disk;
+    struct extract_job_t *jobs;
+    int total_jobs;
+    int next_job;
+    pthread_mutex_t job_mutex;
+};
+
+// Repeatedly claim the next queued file and copy its FAT chain into its own output file
+void *extract_worker(void *arg)
+{
+    struct extract_pool_t *pool = arg;
+    struct disk_t *disk = pool->disk;
+
+    while (true)
+    {
+        // Lock the job mutex and claim the next unprocessed file
+        pthread_mutex_lock(&pool->job_mutex);
+        int idx = pool->next_job++;
+        pthread_mutex_unlock(&pool->job_mutex);
+        if (idx >= pool->total_jobs)
+            break;
+
+        struct extract_job_t *job = &pool->jobs[idx];
+        int out = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out == -1)
+        {
+            job->result = -1;
+            continue;
+        }
+        job->result = extract_chain(out, disk, ntohl(job->entry->starting_block), ntohl(job->entry->size));
+        close(out);
+    }
+    return NULL;
+}
+
+// Extract every file matching any of the given paths into a local directory, where the last component of a path may be a glob pattern; returns -1 if any pattern or file failed
+int disk_get_batch(struct disk_t *disk, const char *directory, char *patterns[], int total_patterns)
+{
+    struct extract_job_t *jobs = NULL;
+    int total_jobs = 0, capacity = 0;
+    bool missing = false;
+
+    for (int p = 0; p < total_patterns; p++)
+    {
+        // Resolve the directories along the path once, leaving the last component to match against
+        char pattern_name[sizeof(((struct dir_entry_t *)0)->filename) + 1];
+        struct dir_index_t *dir = disk_resolve(disk, patterns[p], pattern_name);
+        const char *last = strrchr(patterns[p], '/');
+        int directory_length = last == NULL ? 0 : last - patterns[p] + 1;
+        if (directory_length > 0 && patterns[p][0] == 47)
+            directory_length--;
+
+        // Plain names are looked up through the hash table, only glob patterns need to visit every slot
+        bool pattern = strpbrk(pattern_name, "*?[") != NULL;
+        struct dir_entry_t *named = pattern == true || dir == NULL ? NULL : dir_index_find(dir, pattern_name);
+
+        bool matched = false;
+        for (int i = 0; dir != NULL && i < (pattern == true ? dir->total_entries : named != NULL); i++)
+        {
+            struct dir_entry_t *entry = pattern == true ? dir->entries[i] : named;
+            // Skip entries that are not in use or that are directories
+            if ((entry->status & 0x01) == 0 || (entry->status & 0x02) == 0)
+                continue;
+
+            char name[sizeof(entry->filename) + 1];
+            memcpy(name, entry->filename, sizeof(entry->filename));
+            name[sizeof(entry->filename)] = '\0';
+            if (pattern == true && fnmatch(pattern_name, name, 0) != 0)
+                continue;
+            matched = true;
+
+            // Skip the file if an earlier pattern already queued it
+            bool queued = false;
+            for (int j = 0; j < total_jobs; j++)
+                if (jobs[j].entry == entry)
+                    queued = true;
+            if (queued == true)
+                continue;
+
+            if (total_jobs == capacity)
+            {
+                capacity = capacity == 0 ? 16 : capacity * 2;
+                jobs = realloc(jobs, capacity * sizeof(*jobs));
+            }
+            memset(&jobs[total_jobs], 0, sizeof(*jobs));
+            jobs[total_jobs].entry = entry;
+            jobs[total_jobs].directory = patterns[p][0] == 47 ? patterns[p] + 1 : patterns[p];
+            jobs[total_jobs].directory_length = directory_length;
+            snprintf(jobs[total_jobs].path, sizeof(jobs[total_jobs].path), "%s/%s", directory, name);
+            total_jobs++;
+        }
+
+        if (matched == false)
+        {
+            printf("Error: %s not found\n", patterns[p]);
+            missing = true;
+        }
+    }
+
+    // Size the worker pool to the available cores, but never start more workers than there are files
+    long total_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (total_workers < 1)
+        total_workers = 1;
+    if (total_workers > total_jobs)
+        total_workers = total_jobs;
+
+    struct extract_pool_t pool = {disk, jobs, total_jobs, 0};
+    pthread_mutex_init(&pool.job_mutex, NULL);
+    disk_advise_copy(disk);
+
+    // Only the workers that started are joined; if none could start, this thread extracts every file itself
+    pthread_t *workers = malloc((total_workers > 0 ? total_workers : 1) * sizeof(*workers));
+    int started = 0;
+    for (int i = 0; i < total_workers; i++)
+    {
+        if (pthread_create(&workers[started], NULL, &extract_worker, &pool) != 0)
+            perror("Error at workers[i]");
+        else
+            started++;
+    }
+    if (started == 0)
+        extract_worker(&pool);
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pool.job_mutex);
+
+    // Report the outcome of each file in the order it was matched
+    int failed = 0;
+    for (int i = 0; i < total_jobs; i++)
+    {
+        if (jobs[i].result != 0)
+        {
+            printf("Error: could not extract /%.*s%.31s to %s\n", jobs[i].directory_length, jobs[i].directory, jobs[i].entry->filename, jobs[i].path);
+            failed++;
+        }
+        else
+            printf("Success: found /%.*s%.31s in %s\n", jobs[i].directory_length, jobs[i].directory, jobs[i].entry->filename, disk->path);
+    }
+
+    free(workers);
+    free(jobs);
+    return failed > 0 || missing == true ? -1 : 0;
+}
+
+// A chain to be checked, either a file's, a subdirectory's or the root directory's own, and what its walk found
+struct check_chain_t
+{
+    struct dir_entry_t *entry;
+    // Path of the entry relative to the root
+    char *name;
+    uint32_t start;
+    // Blocks the chain should have, from a file's size, a subdirectory's block count or the super block's root directory block count
+    uint32_t expected;
+    uint32_t length;
+    enum chain_end_t end;
+    uint32_t end_block;
+    // A lower chain that owns a block this one also reaches, found once every walk has finished, or -1 if there is none
+    int crossed_with;
+    uint32_t crossed_block;
+    // The lowest chain of an identical file whose whole chain this file deliberately shares, or -1; that chain lists its sharers through next_sharer
+    int shares;
+    int next_sharer;
+};
+
+// State shared by the threads of a consistency check
+struct check_t
+{
+    const uint8_t *fat;
+    uint32_t block_count;
+    struct check_chain_t *chains;
+    int total_chains;
+    int next_chain;
+    // Lowest index of a chain that reached each block, or UINT32_MAX if none did; claimed with atomic compare and swap
+    uint32_t *owner;
+    int total_threads;
+    int next_range;
+    uint64_t orphans;
+    // Private copies of directories read beyond the mapping, which the checked entries point into
+    uint8_t **copies;
+    int total_copies;
+};
+
+// Mark every block reachable from one chain, atomically claiming each block for the lowest chain index that reaches it
+void check_walk(struct check_t *check, int idx)
+{
+    struct check_chain_t *chain = &check->chains[idx];
+    if (chain->shares != -1)
+        return;
+
+    // A chain can never be longer than the file system, so reaching that limit means the walk is going round a cycle
+    struct chain_walk_t walk;
+    chain_walk_begin(&walk, check->fat, check->block_count, chain->start, check->block_count);
+    uint32_t block;
+    while (chain_walk_next(&walk, &block) == true)
+    {
+        uint32_t old = __atomic_load_n(&check->owner[block], __ATOMIC_RELAXED);
+        while (old > (uint32_t)idx && __atomic_compare_exchange_n(&check->owner[block], &old, idx, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED) == false)
+            ;
+        // Reaching a block this chain already claimed means it loops back on itself
+        if (old == (uint32_t)idx)
+        {
+            chain->end = CHAIN_CYCLE;
+            chain->end_block = block;
+            return;
+        }
+
+        chain->length++;
+    }
+    chain->end = walk.end == CHAIN_LIMIT ? CHAIN_CYCLE : walk.end;
+    chain->end_block = walk.end_block;
+}
+
+// Walk chains claimed from the shared list until none are left
+void *check_mark_worker(void *arg)
+{
+    struct check_t *check = arg;
+    int idx;
+    while ((idx = __atomic_fetch_add(&check->next_chain, 1, __ATOMIC_RELAXED)) < check->total_chains)
+        check_walk(check, idx);
+    return NULL;
+}
+
+// Find the first block of a walked chain that a lower chain owns. Every walk has finished by now, so owner[] holds the lowest chain reaching each block and a conflict always goes to the higher of the two chains, whichever walk got there first
+void check_cross(struct check_t *check, int idx)
+{
+    struct check_chain_t *chain = &check->chains[idx];
+    chain->crossed_with = -1;
+    if (chain->shares != -1)
+        return;
+
+    // Only the blocks the walk counted, which stops a cyclic chain before it goes round again
+    struct chain_walk_t walk;
+    chain_walk_begin(&walk, check->fat, check->block_count, chain->start, chain->length);
+    uint32_t block;
+    while (chain_walk_next(&walk, &block) == true)
+    {
+        if (check->owner[block] != (uint32_t)idx)
+        {
+            chain->crossed_with = check->owner[block];
+            chain->crossed_block = block;
+            return;
+        }
+    }
+}
+
+// Attribute cross-links for chains claimed from the shared list until none are left
+void *check_cross_worker(void *arg)
+{
+    struct check_t *check = arg;
+    int idx;
+    while ((idx = __atomic_fetch_add(&check->next_chain, 1, __ATOMIC_RELAXED)) < check->total_chains)
+        check_cross(check, idx);
+    return NULL;
+}
+
+// Count the allocated blocks that no chain reached, in shares of the FAT claimed until none are left, so the whole FAT is swept however many threads started
+void *check_sweep_worker(void *arg)
+{
+    struct check_t *check = arg;
+    int range;
+    while ((range = __atomic_fetch_add(&check->next_range, 1, __ATOMIC_RELAXED)) < check->total_threads)
+    {
+        uint32_t first = (uint64_t)check->block_count * range / check->total_threads;
+        uint32_t last = (uint64_t)check->block_count * (range + 1) / check->total_threads;
+
+        uint64_t orphans = 0;
+        for (uint32_t b = first; b < last; b++)
+        {
+            uint32_t val = fat_entry(check->fat, b);
+            if (val != 0 && val != 1 && check->owner[b] == UINT32_MAX)
+                orphans++;
+        }
+        __atomic_fetch_add(&check->orphans, orphans, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Run the same worker on every thread of the check and wait for all of them; only the threads that started are joined, and if none could start the calling thread runs the worker itself
+void check_run(struct check_t *check, void *(*worker)(void *))
+{
+    pthread_t threads[check->total_threads];
+    int started = 0;
+    for (int i = 0; i < check->total_threads; i++)
+    {
+        if (pthread_create(&threads[started], NULL, worker, check) != 0)
+            perror("Error at threads[i]");
+        else
+            started++;
+    }
+    if (started == 0)
+        worker(check);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+}
+
+// Mark every chain in parallel, attribute cross-links in parallel once every chain is marked, then give each file sharing another's chain what the walk of that chain found
+void check_mark(struct check_t *check)
+{
+    check_run(check, check_mark_worker);
+    check->next_chain = 0;
+    check_run(check, check_cross_worker);
+    for (int i = 0; i < check->total_chains; i++)
+    {
+        struct check_chain_t *chain = &check->chains[i];
+        if (chain->shares == -1)
+            continue;
+        struct check_chain_t *shared = &check->chains[chain->shares];
+        chain->length = shared->length;
+        chain->end = shared->end;
+        chain->end_block = shared->end_block;
+        chain->crossed_with = shared->crossed_with;
+        chain->crossed_block = shared->crossed_block;
+    }
+}
+
+// Order files by first block, then by blocks needed and then by size, keeping equal files in chain order
+int compare_check_share(const void *a, const void *b)
+{
+    const uint32_t *x = a, *y = b;
+    for (int i = 0; i < 4; i++)
+        if (x[i] != y[i])
+            return x[i] < y[i] ? -1 : 1;
+    return 0;
+}
+
+// Release the memory held by a consistency check
+void check_release(struct check_t *check)
+{
+    for (int i = 0; i < check->total_chains; i++)
+        free(check->chains[i].name);
+    for (int i = 0; i < check->total_copies; i++)
+        free(check->copies[i]);
+    free(check->copies);
+    free(check->chains);
+    free(check->owner);
+}
+
+// Stage a FAT entry update through the journal
+void fat_stage(struct disk_t *disk, uint32_t block, uint32_t val)
+{
+    size_t start = (size_t)ntohl(disk->sb->fat_start_block) * ntohs(disk->sb->block_size);
+    val = htonl(val);
+    journal_stage(disk, start + (size_t)block * 4, &val, 4);
+}
+
+// Set up a check of every chain reachable from the root directory through any depth of subdirectories, reading each directory's entries in the order the directories are found
+void check_collect(struct check_t *check, struct disk_t *disk)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+    memset(check, 0, sizeof(*check));
+    check->fat = disk->fat;
+    check->block_count = disk->block_count;
+    check->owner = malloc(((size_t)check->block_count + 1) * sizeof(*check->owner));
+    memset(check->owner, 0xFF, ((size_t)check->block_count + 1) * sizeof(*check->owner));
+
+    // The root directory's own chain comes first, so it keeps any block a file also claims
+    int capacity = 64;
+    check->chains = calloc(capacity, sizeof(*check->chains));
+    check->chains[0].name = strdup("");
+    check->chains[0].start = ntohl(disk->sb->root_dir_start_block);
+    check->chains[0].expected = ntohl(disk->sb->root_dir_block_count);
+    check->chains[0].shares = check->chains[0].next_sharer = -1;
+    check->total_chains = 1;
+
+    // Visit the directories in the order they are found, each adding its entries behind the ones already queued; a directory reached twice is only read once
+    uint8_t *visited = calloc(check->block_count / 8 + 1, 1);
+    for (int d = 0; d < check->total_chains; d++)
+    {
+        struct dir_entry_t *directory = check->chains[d].entry;
+        uint32_t first = check->chains[d].start;
+        if ((directory != NULL && (directory->status & 0x04) == 0) || first >= check->block_count || (visited[first / 8] & 1 << (first % 8)) != 0)
+            continue;
+        visited[first / 8] |= 1 << (first % 8);
+
+        // The root directory is the super block's contiguous extent, a subdirectory only as much of its chain as it records
+        struct dir_entry_t **slots;
+        uint8_t *copy;
+        int total_slots;
+        if (directory == NULL)
+        {
+            struct extent_t root = {first, check->chains[d].expected};
+            total_slots = disk_dir_slots(disk, &root, 1, &slots, &copy);
+        }
+        else
+        {
+            struct chain_t chain;
+            chain_resolve(check->fat, check->block_count, first, check->chains[d].expected, &chain);
+            total_slots = disk_dir_slots(disk, chain.extents, chain.total_extents, &slots, &copy);
+            chain_destroy(&chain);
+        }
+
+        for (int i = 0; i < total_slots; i++)
+        {
+            struct dir_entry_t *entry = slots[i];
+            if ((entry->status & 0x01) == 0)
+                continue;
+            if (check->total_chains == capacity)
+            {
+                capacity *= 2;
+                check->chains = realloc(check->chains, capacity * sizeof(*check->chains));
+            }
+            struct check_chain_t *chain = &check->chains[check->total_chains++];
+            memset(chain, 0, sizeof(*chain));
+            chain->shares = chain->next_sharer = -1;
+            chain->entry = entry;
+            const char *parent = check->chains[d].name;
+            chain->name = malloc(strlen(parent) + sizeof(entry->filename) + 2);
+            sprintf(chain->name, "%s%s%.31s", parent, parent[0] == '\0' ? "" : "/", entry->filename);
+            chain->start = ntohl(entry->starting_block);
+            // A subdirectory needs the blocks it records, a file the blocks its size needs
+            if ((entry->status & 0x04) != 0)
+                chain->expected = ntohl(entry->block_count);
+            else
+                chain->expected = ntohl(entry->size) / size + (ntohl(entry->size) % size != 0);
+            // An empty file has no chain at all, whatever its starting block says
+            if (chain->expected == 0)
+                chain->start = 0xFFFFFFFF;
+        }
+        free(slots);
+        if (copy != NULL)
+        {
+            check->copies = realloc(check->copies, (check->total_copies + 1) * sizeof(*check->copies));
+            check->copies[check->total_copies++] = copy;
+        }
+    }
+    free(visited);
+
+    // Files put with deduplication start at the same block and have the same size as the file they share with; only the lowest of them is walked
+    uint32_t *files = malloc(check->total_chains * 4 * sizeof(*files));
+    int total_files = 0;
+    for (int i = 1; i < check->total_chains; i++)
+    {
+        struct check_chain_t *chain = &check->chains[i];
+        if ((chain->entry->status & 0x04) != 0 || chain->expected == 0)
+            continue;
+        files[total_files * 4] = chain->start;
+        files[total_files * 4 + 1] = chain->expected;
+        files[total_files * 4 + 2] = ntohl(chain->entry->size);
+        files[total_files * 4 + 3] = i;
+        total_files++;
+    }
+    qsort(files, total_files, 4 * sizeof(*files), compare_check_share);
+    bool clean = false;
+    for (int f = 1; f < total_files; f++)
+    {
+        uint32_t *file = &files[f * 4], *previous = file - 4;
+        if (file[0] != previous[0] || file[1] != previous[1] || file[2] != previous[2])
+            continue;
+        struct check_chain_t *chain = &check->chains[file[3]];
+        struct check_chain_t *before = &check->chains[previous[3]];
+
+        // Only a chain that reaches its end marker after exactly the blocks the files need can be shared; files that meet in a broken chain are cross-linked
+        if (before->shares == -1)
+        {
+            struct chain_walk_t walk;
+            chain_walk_begin(&walk, check->fat, check->block_count, chain->start, chain->expected);
+            uint32_t length = 0, block;
+            while (chain_walk_next(&walk, &block) == true)
+                length++;
+            clean = walk.end == CHAIN_END && length == chain->expected;
+        }
+        if (clean == false)
+            continue;
+        chain->shares = before->shares == -1 ? (int)previous[3] : before->shares;
+        before->next_sharer = file[3];
+    }
+    free(files);
+}
+
+// Check every chain reachable from the root directory through any depth of subdirectories against the FAT, and optionally repair what is found through the journal; returns the number of problems left unrepaired
+int disk_fix(struct disk_t *disk, bool repair)
+{
+    uint32_t size = ntohs(disk->sb->block_size);
+
+    struct check_t check;
+    check_collect(&check, disk);
+
+    // Mark in parallel, then sweep the FAT for orphans in parallel once every chain is marked
+    long total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    check.total_threads = total_threads < 1 ? 1 : total_threads;
+    check_mark(&check);
+    check_run(&check, check_sweep_worker);
+
+    // Report what each chain's walk found
+    int problems = 0;
+    for (int i = 0; i < check.total_chains; i++)
+    {
+        struct check_chain_t *chain = &check.chains[i];
+        const char *name = chain->name;
+        if (chain->end == CHAIN_OUT_OF_RANGE)
+            printf("Error: /%s chain points outside the image at block %u\n", name, chain->end_block);
+        else if (chain->end == CHAIN_UNALLOCATED)
+            printf("Error: /%s chain reaches unallocated block %u\n", name, chain->end_block);
+        else if (chain->end == CHAIN_CYCLE)
+            printf("Error: /%s chain is cyclic at block %u\n", name, chain->end_block);
+        problems += chain->end != CHAIN_END;
+
+        if (chain->crossed_with != -1)
+        {
+            printf("Error: /%s shares block %u with /%s\n", name, chain->crossed_block, check.chains[chain->crossed_with].name);
+            problems++;
+        }
+        // The length of a chain that did not end properly says nothing more about it
+        if (chain->end != CHAIN_END)
+            continue;
+        if (chain->length != chain->expected)
+        {
+            printf("Error: /%s has %u blocks but needs %u\n", name, chain->length, chain->expected);
+            problems++;
+        }
+        if (chain->entry != NULL && ntohl(chain->entry->block_count) != chain->length)
+        {
+            printf("Error: /%s records %u blocks but its chain has %u\n", name, ntohl(chain->entry->block_count), chain->length);
+            problems++;
+        }
+    }
+    if (check.orphans > 0)
+    {
+        printf("Error: %llu allocated blocks are not reachable from any file\n", (unsigned long long)check.orphans);
+        problems++;
+    }
+    int sharers = 0;
+    for (int i = 0; i < check.total_chains; i++)
+        sharers += check.chains[i].shares != -1;
+    if (sharers > 0)
+        printf("Shared: %d files share the chain of an identical file\n", sharers);
+    printf("Checked %d chains across %u blocks with %d threads: %d problems found\n", check.total_chains, check.block_count, check.total_threads, problems);
+
+    if (repair == false || problems == 0)
+    {
+        check_release(&check);
+        return problems;
+    }
+
+    // Repair in chain order: each chain keeps the leading blocks it owns, up to the blocks it needs, and is terminated after the last one
+    uint8_t *kept = calloc(check.block_count / 8 + 1, 1);
+    uint32_t *lengths = malloc(check.total_chains * sizeof(*lengths));
+    for (int i = 0; i < check.total_chains; i++)
+    {
+        struct check_chain_t *chain = &check.chains[i];
+        uint32_t length = 0, last = 0xFFFFFFFF;
+        struct chain_walk_t walk;
+        // A file sharing another's chain keeps what that chain kept
+        chain_walk_begin(&walk, check.fat, check.block_count, chain->start, chain->shares == -1 ? chain->expected : 0);
+        if (chain->shares != -1)
+            length = lengths[chain->shares];
+        uint32_t block;
+        while (chain_walk_next(&walk, &block) == true)
+        {
+            if (check.owner[block] != (uint32_t)i || (kept[block / 8] & 1 << (block % 8)) != 0)
+                break;
+            kept[block / 8] |= 1 << (block % 8);
+            last = block;
+            length++;
+        }
+        if (last != 0xFFFFFFFF && fat_entry(check.fat, last) != 0xFFFFFFFF)
+            fat_stage(disk, last, 0xFFFFFFFF);
+        lengths[i] = length;
+
+        // The root directory has no entry; files and subdirectories that lost blocks are shortened to what remains
+        if (chain->entry == NULL)
+            continue;
+        struct dir_entry_t entry = *chain->entry;
+        uint64_t bytes = (uint64_t)length * size;
+        if (ntohl(entry.size) > bytes)
+            entry.size = htonl(bytes);
+        entry.block_count = htonl(length);
+        if (length == 0)
+            entry.starting_block = htonl(0xFFFFFFFF);
+        if (memcmp(&entry, chain->entry, sizeof(entry)) != 0)
+            journal_stage(disk, (uint8_t *)chain->entry - disk->address, &entry, sizeof(entry));
+    }
+
+    // Free every allocated block that no chain kept, including the tails cut off above
+    uint64_t freed = 0;
+    for (uint32_t b = 0; b < check.block_count; b++)
+    {
+        uint32_t val = fat_entry(check.fat, b);
+        if (val != 0 && val != 1 && (kept[b / 8] & 1 << (b % 8)) == 0)
+        {
+            fat_stage(disk, b, 0);
+            freed++;
+        }
+    }
+    free(kept);
+    free(lengths);
+    check_release(&check);
+
+    if (disk_commit(disk) == -1)
+        return problems;
+
+    // The repairs changed the FAT and directory underneath the cached indexes
+    disk_invalidate(disk);
+
+    printf("Repaired: %llu blocks freed\n", (unsigned long long)freed);
+    return 0;
+}
+
+// Owners of a block during defragmentation other than a chain index: a free block, a block freed by staged updates that are not committed yet so its contents must survive until they are, and a block that is never moved
+#define DEFRAG_FREE 0xFFFFFFFF
+#define DEFRAG_PENDING 0xFFFFFFFE
+#define DEFRAG_FIXED 0xFFFFFFFD
+
+// Layout of every movable chain as it will be once the staged updates commit
+struct defrag_t
+{
+    struct disk_t *disk;
+    struct check_t check;
+    uint32_t size;
+    uint32_t block_count;
+    uint32_t *owner;
+    // Neighbours of each block in its chain, 0xFFFFFFFF at either end
+    uint32_t *next;
+    uint32_t *prev;
+    // First block of each chain, by chain index
+    uint32_t *head;
+    // Blocks freed since the last commit
+    uint32_t *pending;
+    uint32_t total_pending;
+    // Where the search for a free block to move a block out of the way to resumes, from the top of the image down
+    uint32_t spare;
+    bool dry_run;
+    uint64_t copied_blocks;
+    int moved_chains;
+};
+
+// Make the staged updates durable, after which the blocks they freed can be reused; returns -1 if the commit failed
+int defrag_commit(struct defrag_t *defrag)
+{
+    if (defrag->dry_run == false && disk_commit(defrag->disk) == -1)
+        return -1;
+    for (uint32_t i = 0; i < defrag->total_pending; i++)
+        defrag->owner[defrag->pending[i]] = DEFRAG_FREE;
+    defrag->total_pending = 0;
+    return 0;
+}
+
+// Find a free block at or above floor, searching down from the top of the image so blocks that make way stay clear of where files are being packed; returns DEFRAG_FREE if there is none
+uint32_t defrag_spare(struct defrag_t *defrag, uint32_t floor)
+{
+    for (int pass = 0; pass < 2; pass++)
+    {
+        while (defrag->spare > floor && defrag->owner[defrag->spare - 1] != DEFRAG_FREE)
+            defrag->spare--;
+        if (defrag->spare > floor)
+            return --defrag->spare;
+        // Blocks freed by commits since the search passed them are worth a second look
+        defrag->spare = defrag->block_count;
+    }
+    return DEFRAG_FREE;
+}
+
+// Point whatever refers to a chain's block at a new block: the previous block's FAT entry, or the directory entries for the first block
+void defrag_relink(struct defrag_t *defrag, int chain, uint32_t previous, uint32_t block)
+{
+    if (previous != 0xFFFFFFFF)
+        fat_stage(defrag->disk, previous, block);
+    else
+    {
+        // Every file sharing the chain starts at its first block too
+        uint32_t first = htonl(block);
+        for (int c = chain; c != -1; c = defrag->check.chains[c].next_sharer)
+            journal_stage(defrag->disk, (uint8_t *)defrag->check.chains[c].entry - defrag->disk->address + 1, &first, 4);
+    }
+}
+
+// Move a single block of a chain out of the way to a free block, relinking the chain around it
+void defrag_move_block(struct defrag_t *defrag, uint32_t block, uint32_t to)
+{
+    uint32_t chain = defrag->owner[block];
+    uint32_t next = defrag->next[block], previous = defrag->prev[block];
+    if (defrag->dry_run == false)
+    {
+        struct disk_t *disk = defrag->disk;
+        memcpy(disk->address + (size_t)to * defrag->size, disk->address + (size_t)block * defrag->size, defrag->size);
+        flush_batch_add(&disk->batch, (size_t)to * defrag->size, defrag->size);
+        disk_sums_move(disk, to, block, 1);
+        fat_stage(disk, to, next);
+        defrag_relink(defrag, chain, previous, to);
+        fat_stage(disk, block, 0);
+    }
+
+    defrag->next[to] = next;
+    defrag->prev[to] = previous;
+    if (next != 0xFFFFFFFF)
+        defrag->prev[next] = to;
+    if (previous != 0xFFFFFFFF)
+        defrag->next[previous] = to;
+    else
+        defrag->head[chain] = to;
+    defrag->owner[to] = chain;
+    defrag->owner[block] = DEFRAG_PENDING;
+    defrag->pending[defrag->total_pending++] = block;
+    defrag->copied_blocks++;
+}
+
+// Rebuild a chain as one contiguous extent starting at *cursor, past any fixed blocks, and advance *cursor past it; blocks in the way are moved up the image first. Returns -1 if a commit failed, 1 if there is no room left to move blocks out of the way, and 0 otherwise, including when the chain cannot be placed and stays where it is
+int defrag_place(struct defrag_t *defrag, int chain, uint32_t *cursor)
+{
+    uint32_t length = defrag->check.chains[chain].expected;
+
+    // The extent has to step over fixed blocks, since those never move
+    uint32_t start = *cursor;
+    for (uint32_t b = start; b < start + length && start + length <= defrag->block_count; b++)
+        if (defrag->owner[b] == DEFRAG_FIXED)
+            start = b + 1;
+    if (start + length > defrag->block_count)
+        return 0;
+
+    // Gather the chain's blocks in order, and leave it be if it already sits in the extent
+    uint32_t *blocks = malloc((size_t)length * sizeof(*blocks));
+    bool placed = true;
+    uint32_t block = defrag->head[chain];
+    for (uint32_t k = 0; k < length; k++, block = defrag->next[block])
+    {
+        blocks[k] = block;
+        placed = placed && block == start + k;
+    }
+    if (placed == true)
+    {
+        free(blocks);
+        *cursor = start + length;
+        return 0;
+    }
+
+    // Clear the extent of other chains' blocks and of this chain's blocks that are out of place; the cleared blocks, and any freed since the last commit, may only be overwritten once the moves are committed
+    bool commit = false;
+    for (uint32_t k = 0; k < length; k++)
+    {
+        uint32_t b = start + k;
+        uint32_t owner = defrag->owner[b];
+        commit = commit || owner == DEFRAG_PENDING;
+        if (owner == DEFRAG_FREE || owner == DEFRAG_PENDING || (owner == (uint32_t)chain && blocks[b - start] == b))
+            continue;
+
+        uint32_t to = defrag_spare(defrag, start + length);
+        if (to == DEFRAG_FREE)
+        {
+            printf("Stopped at /%s: no free block left to move block %u out of its way\n", defrag->check.chains[chain].name, b);
+            free(blocks);
+            return 1;
+        }
+        if (owner == (uint32_t)chain)
+        {
+            for (uint32_t j = 0; j < length; j++)
+                if (blocks[j] == b)
+                    blocks[j] = to;
+        }
+        defrag_move_block(defrag, b, to);
+        commit = true;
+    }
+    if (commit == true && defrag_commit(defrag) == -1)
+    {
+        free(blocks);
+        return -1;
+    }
+
+    // Copy each run of blocks that are contiguous at their source with one large copy
+    struct disk_t *disk = defrag->disk;
+    uint32_t size = defrag->size;
+    for (uint32_t k = 0; k < length;)
+    {
+        if (blocks[k] == start + k)
+        {
+            k++;
+            continue;
+        }
+        uint32_t run = 1;
+        while (k + run < length && blocks[k + run] == blocks[k] + run)
+            run++;
+        if (defrag->dry_run == false)
+        {
+            memcpy(disk->address + (size_t)(start + k) * size, disk->address + (size_t)blocks[k] * size, (size_t)run * size);
+            flush_batch_add(&disk->batch, (size_t)(start + k) * size, (size_t)run * size);
+            disk_sums_move(disk, start + k, blocks[k], run);
+        }
+        for (uint32_t j = k; j < k + run; j++)
+        {
+            if (defrag->dry_run == false)
+                fat_stage(disk, blocks[j], 0);
+            defrag->owner[blocks[j]] = DEFRAG_PENDING;
+            defrag->pending[defrag->total_pending++] = blocks[j];
+        }
+        defrag->copied_blocks += run;
+        k += run;
+    }
+
+    // Link the extent as one update, then point the directory entry at it
+    if (defrag->dry_run == false)
+    {
+        uint32_t *links = malloc((size_t)length * 4);
+        for (uint32_t k = 0; k < length; k++)
+            links[k] = htonl(k + 1 < length ? start + k + 1 : 0xFFFFFFFF);
+        journal_stage(disk, (size_t)ntohl(disk->sb->fat_start_block) * size + (size_t)start * 4, links, length * 4);
+        free(links);
+        if (blocks[0] != start)
+            defrag_relink(defrag, chain, 0xFFFFFFFF, start);
+    }
+    for (uint32_t k = 0; k < length; k++)
+    {
+        defrag->owner[start + k] = chain;
+        defrag->next[start + k] = k + 1 < length ? start + k + 1 : 0xFFFFFFFF;
+        defrag->prev[start + k] = k > 0 ? start + k - 1 : 0xFFFFFFFF;
+    }
+    defrag->head[chain] = start;
+    defrag->moved_chains++;
+    free(blocks);
+
+    *cursor = start + length;
+    // Let the moves of many small files share one commit
+    if (defrag->dry_run == false && disk->journal.length >= JOURNAL_LIMIT)
+        return defrag_commit(defrag);
+    return 0;
+}
+
+// Percentage of links between consecutive blocks of the movable chains that jump anywhere but the next block, and the number of free extents
+double defrag_score(struct defrag_t *defrag, uint32_t *free_extents)
+{
+    uint64_t links = 0, jumps = 0;
+    for (int i = 0; i < defrag->check.total_chains; i++)
+    {
+        if (defrag->head[i] == 0xFFFFFFFF)
+            continue;
+        for (uint32_t b = defrag->head[i]; defrag->next[b] != 0xFFFFFFFF; b = defrag->next[b])
+        {
+            links++;
+            jumps += defrag->next[b] != b + 1;
+        }
+    }
+
+    *free_extents = 0;
+    for (uint32_t b = 0; b < defrag->block_count; b++)
+    {
+        bool free_block = defrag->owner[b] == DEFRAG_FREE || defrag->owner[b] == DEFRAG_PENDING;
+        bool free_before = b > 0 && (defrag->owner[b - 1] == DEFRAG_FREE || defrag->owner[b - 1] == DEFRAG_PENDING);
+        *free_extents += free_block == true && free_before == false;
+    }
+    return links > 0 ? 100.0 * jumps / links : 0.0;
+}
+
+// Order chains by their first block
+int compare_chain_head(const void *a, const void *b)
+{
+    const uint32_t *x = a, *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+// Pack every file into one contiguous extent, in the order the files start, so free space collects at the end of the image; with dry_run nothing is written and the result is only reported. Returns -1 if a commit failed
+int disk_defrag(struct disk_t *disk, bool dry_run)
+{
+    struct defrag_t defrag = {disk};
+    defrag.size = ntohs(disk->sb->block_size);
+    defrag.block_count = disk->block_count;
+    defrag.dry_run = dry_run;
+
+    // Walk every chain with the checker, which finds the blocks each chain owns and any chain that is damaged
+    check_collect(&defrag.check, disk);
+    long total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    defrag.check.total_threads = total_threads < 1 ? 1 : total_threads;
+    check_mark(&defrag.check);
+
+    // Only whole file chains move, taking along the files that share them; directories, reserved blocks, orphans and damaged chains stay where they are
+    struct check_t *check = &defrag.check;
+    bool *movable = calloc(check->total_chains, sizeof(*movable));
+    for (int i = 1; i < check->total_chains; i++)
+    {
+        struct check_chain_t *chain = &check->chains[i];
+        movable[i] = (chain->entry->status & 0x04) == 0 && chain->expected > 0 && chain->shares == -1 && chain->end == CHAIN_END && chain->length == chain->expected;
+    }
+    for (int i = 1; i < check->total_chains; i++)
+    {
+        struct check_chain_t *chain = &check->chains[i];
+        if (chain->crossed_with != -1)
+            movable[i] = movable[chain->crossed_with] = false;
+    }
+
+    defrag.owner = malloc((size_t)defrag.block_count * sizeof(*defrag.owner));
+    defrag.next = malloc((size_t)defrag.block_count * sizeof(*defrag.next));
+    defrag.prev = malloc((size_t)defrag.block_count * sizeof(*defrag.prev));
+    defrag.pending = malloc((size_t)defrag.block_count * sizeof(*defrag.pending));
+    defrag.head = malloc(check->total_chains * sizeof(*defrag.head));
+    defrag.spare = defrag.block_count;
+    for (uint32_t b = 0; b < defrag.block_count; b++)
+        defrag.owner[b] = fat_entry(disk->fat, b) == 0 ? DEFRAG_FREE : DEFRAG_FIXED;
+
+    int skipped = 0;
+    uint32_t *order = malloc(check->total_chains * 2 * sizeof(*order));
+    int total_order = 0;
+    for (int i = 0; i < check->total_chains; i++)
+    {
+        defrag.head[i] = 0xFFFFFFFF;
+        if (movable[i] == false)
+        {
+            if (i > 0 && (check->chains[i].entry->status & 0x04) == 0 && check->chains[i].expected > 0 && check->chains[i].shares == -1)
+            {
+                printf("Skipping /%s: its chain is damaged, run diskfix -r first\n", check->chains[i].name);
+                skipped++;
+            }
+            continue;
+        }
+
+        struct chain_walk_t walk;
+        chain_walk_begin(&walk, disk->fat, defrag.block_count, check->chains[i].start, check->chains[i].expected);
+        uint32_t block, previous = 0xFFFFFFFF;
+        while (chain_walk_next(&walk, &block) == true)
+        {
+            defrag.owner[block] = i;
+            defrag.prev[block] = previous;
+            defrag.next[block] = 0xFFFFFFFF;
+            if (previous != 0xFFFFFFFF)
+                defrag.next[previous] = block;
+            previous = block;
+        }
+        defrag.head[i] = check->chains[i].start;
+        order[total_order * 2] = defrag.head[i];
+        order[total_order * 2 + 1] = i;
+        total_order++;
+    }
+    free(movable);
+
+    uint32_t free_before, free_after;
+    double score_before = defrag_score(&defrag, &free_before);
+    printf("Fragmentation before: %.1f%% of links discontiguous, %u free extents\n", score_before, free_before);
+
+    // Packing files in the order they already start keeps the distance each one moves short
+    qsort(order, total_order, 2 * sizeof(*order), compare_chain_head);
+    struct timespec begin, now, reported;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    reported = begin;
+    uint32_t cursor = 0;
+    int result = 0;
+    for (int i = 0; i < total_order && result == 0; i++)
+    {
+        result = defrag_place(&defrag, order[i * 2 + 1], &cursor);
+
+        // Report progress about once a second on long runs
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (dry_run == false && (now.tv_sec - reported.tv_sec) * 1000000000L + now.tv_nsec - reported.tv_nsec >= 1000000000L)
+        {
+            double elapsed = (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1000000000.0;
+            fprintf(stderr, "Placed %d of %d files, copied %.1f MB at %.1f MB/s\n", i + 1, total_order, defrag.copied_blocks * defrag.size / 1048576.0,
+                    defrag.copied_blocks * defrag.size / 1048576.0 / elapsed);
+            reported = now;
+        }
+    }
+    // Running out of room only ends the packing early; everything staged so far is still consistent
+    if (result == 1)
+        result = 0;
+    if (defrag_commit(&defrag) == -1)
+        result = -1;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - begin.tv_sec) + (now.tv_nsec - begin.tv_nsec) / 1000000000.0;
+
+    double score_after = defrag_score(&defrag, &free_after);
+    double megabytes = defrag.copied_blocks * defrag.size / 1048576.0;
+    if (dry_run == true)
+        printf("Dry run: would move %d files, copying %llu blocks (%.1f MB)\n", defrag.moved_chains, (unsigned long long)defrag.copied_blocks, megabytes);
+    else
+        printf("Moved %d files, copying %llu blocks (%.1f MB) in %.2f s (%.1f MB/s)\n", defrag.moved_chains, (unsigned long long)defrag.copied_blocks, megabytes,
+               elapsed, elapsed > 0 ? megabytes / elapsed : 0.0);
+    printf("Fragmentation after: %.1f%% of links discontiguous, %u free extents%s\n", score_after, free_after, skipped > 0 ? ", damaged files left in place" : "");
+
+    free(order);
+    free(defrag.owner);
+    free(defrag.next);
+    free(defrag.prev);
+    free(defrag.pending);
+    free(defrag.head);
+    check_release(&defrag.check);
+
+    // The moves changed the FAT and directory entries underneath the cached indexes
+    if (dry_run == false && defrag.moved_chains > 0)
+        disk_invalidate(disk);
+    return result;
+}
+
+// Blocks claimed at a time by a thread checking or building the checksum table
+#define VERIFY_RANGE 8192
+
+// State shared by the threads of a scrub, or of building a new checksum table
+struct verify_t
+{
+    struct disk_t *disk;
+    // Checksums of a table being built, or NULL when checking against the table
+    uint32_t *build;
+    uint32_t next_range;
+    uint32_t total_ranges;
+    int total_threads;
+    uint64_t checked;
+    pthread_mutex_t lock;
+    uint32_t *bad;
+    int total_bad;
+    int capacity;
+};
+
+// Checksum ranges of blocks claimed from the shared counter until none are left: every block when building a table, only the runs of allocated blocks when checking one
+void *verify_worker(void *arg)
+{
+    struct verify_t *verify = arg;
+    struct disk_t *disk = verify->disk;
+    uint32_t size = ntohs(disk->sb->block_size);
+    uint32_t *sums = malloc(VERIFY_RANGE * sizeof(*sums));
+    uint8_t *buffer = NULL;
+    uint64_t checked = 0;
+
+    uint32_t range;
+    while ((range = __atomic_fetch_add(&verify->next_range, 1, __ATOMIC_RELAXED)) < verify->total_ranges)
+    {
+        uint32_t first = range * VERIFY_RANGE;
+        uint32_t last = disk->block_count - first < VERIFY_RANGE ? disk->block_count : first + VERIFY_RANGE;
+        for (uint32_t b = first; b < last;)
+        {
+            uint32_t val = fat_entry(disk->fat, b);
+            if (verify->build == NULL && (val == 0 || val == 1))
+            {
+                b++;
+                continue;
+            }
+            uint32_t end = b + 1;
+            while (end < last && (verify->build != NULL || ((val = fat_entry(disk->fat, end)) != 0 && val != 1)))
+                end++;
+
+            // Blocks past the end of the mapping are read with pread instead
+            const uint8_t *data = disk->address + (size_t)b * size;
+            if ((size_t)end * size > disk->mapped)
+            {
+                if (buffer == NULL)
+                    buffer = malloc((size_t)VERIFY_RANGE * size);
+                if (pread(disk->fd, buffer, (size_t)(end - b) * size, (size_t)b * size) != (ssize_t)(end - b) * size)
+                {
+                    perror("Error at pread");
+                    b = end;
+                    continue;
+                }
+                data = buffer;
+            }
+            crc32c_blocks(data, size, end - b, sums);
+
+            for (uint32_t k = 0; k < end - b; k++)
+            {
+                if (verify->build != NULL)
+                    verify->build[b + k] = htonl(sums[k]);
+                else if (htonl(sums[k]) != disk->sums[b + k])
+                {
+                    pthread_mutex_lock(&verify->lock);
+                    if (verify->total_bad == verify->capacity)
+                    {
+                        verify->capacity = verify->capacity == 0 ? 64 : verify->capacity * 2;
+                        verify->bad = realloc(verify->bad, verify->capacity * sizeof(*verify->bad));
+                    }
+                    verify->bad[verify->total_bad++] = b + k;
+                    pthread_mutex_unlock(&verify->lock);
+                }
+            }
+            checked += end - b;
+            b = end;
+        }
+    }
+    __atomic_fetch_add(&verify->checked, checked, __ATOMIC_RELAXED);
+    free(buffer);
+    free(sums);
+    return NULL;
+}
+
+// Run the verify workers on every core and wait for all of them, returning the seconds taken
+double verify_run(struct verify_t *verify)
+{
+    long total_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    verify->total_threads = total_threads < 1 ? 1 : total_threads;
+    verify->total_ranges = (verify->disk->block_count + VERIFY_RANGE - 1) / VERIFY_RANGE;
+    pthread_mutex_init(&verify->lock, NULL);
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    // Only the threads that started are joined, and reported; if none could start, this thread verifies every range itself
+    pthread_t threads[verify->total_threads];
+    int started = 0;
+    for (int i = 0; i < verify->total_threads; i++)
+    {
+        if (pthread_create(&threads[started], NULL, verify_worker, verify) != 0)
+            perror("Error at threads[i]");
+        else
+            started++;
+    }
+    if (started == 0)
+        verify_worker(verify);
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    verify->total_threads = started > 0 ? started : 1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    pthread_mutex_destroy(&verify->lock);
+    return (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1000000000.0;
+}
+
+// Write a new checksum table covering every block of the image beside it, replacing any table it had; returns -1 if the table could not be written
+int disk_sums_create(struct disk_t *disk)
+{
+    if (disk_commit(disk) == -1)
+        return -1;
+    struct verify_t verify = {disk};
+    verify.build = malloc(16 + (size_t)disk->block_count * 4);
+    uint8_t *table = (uint8_t *)verify.build;
+    verify.build += 4;
+    double elapsed = verify_run(&verify);
+
+    uint32_t header[2] = {htonl(ntohs(disk->sb->block_size)), htonl(disk->block_count)};
+    memcpy(table, "CSC360CK", 8);
+    memcpy(table + 8, header, 8);
+    char path[PATH_MAX + 8];
+    snprintf(path, sizeof(path), "%s.crc", disk->path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int result = 0;
+    if (fd == -1 || write_all(fd, table, 16 + (size_t)disk->block_count * 4) == -1 || fsync(fd) == -1)
+    {
+        perror("Error at crc");
+        result = -1;
+    }
+    if (fd != -1)
+        close(fd);
+    free(table);
+    if (result == -1)
+        return -1;
+
+    // Start using the new table in place of the old one
+    if (disk->sums != NULL)
+        munmap(disk->sums_address, disk->sums_size);
+    disk->sums = NULL;
+    disk_sums_open(disk);
+    printf("Created %s covering %u blocks with %d threads in %.2f s\n", path, disk->block_count, verify.total_threads, elapsed);
+    return 0;
+}
+
+// Order block numbers ascending
+int compare_block(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Scrub every allocated block against the checksum table across all cores, naming the file behind each block that fails; returns the number of bad blocks, or -1 if the image has no table
+int disk_verify(struct disk_t *disk)
+{
+    if (disk->sums == NULL)
+    {
+        printf("Error: %s has no checksum table, create one with diskverify -i\n", disk->path);
+        return -1;
+    }
+    disk_advise_copy(disk);
+    struct verify_t verify = {disk};
+    double elapsed = verify_run(&verify);
+
+    // Only when something failed is it worth walking every chain to learn which files own the bad blocks
+    if (verify.total_bad > 0)
+    {
+        qsort(verify.bad, verify.total_bad, sizeof(*verify.bad), compare_block);
+        struct check_t check;
+        check_collect(&check, disk);
+        check.total_threads = verify.total_threads;
+        check_mark(&check);
+        for (int i = 0; i < verify.total_bad; i++)
+        {
+            uint32_t owner = check.owner[verify.bad[i]];
+            if (owner == UINT32_MAX)
+                printf("Error: block %u fails its checksum and belongs to no file\n", verify.bad[i]);
+            else
+                printf("Error: block %u of /%s fails its checksum\n", verify.bad[i], check.chains[owner].name);
+        }
+        check_release(&check);
+    }
+
+    double megabytes = verify.checked * ntohs(disk->sb->block_size) / 1048576.0;
+    printf("Verified %llu blocks (%.1f MB) with %d threads in %.2f s (%.1f MB/s): %d bad blocks\n", (unsigned long long)verify.checked, megabytes, verify.total_threads, elapsed,
+           elapsed > 0 ? megabytes / elapsed : 0.0, verify.total_bad);
+    free(verify.bad);
+    return verify.total_bad;
+}
+
+// Shape of a synthetic image built by diskmkfs
+struct mkfs_options_t
+{
+    uint32_t block_size;
+    uint32_t block_count;
+    // Blocks given to the root directory, or 0 to size it from the expected number of files
+    uint32_t root_blocks;
+    // Fraction of the data blocks to fill with files
+    double fill;
+    // Mean file size in bytes, and how sizes are spread around it: 'f' fixed, 'u' uniform or 'e' exponential
+    uint32_t mean_size;
+    char distribution;
+    // Chance that the next block of a file is placed at a random free block instead of the next free one
+    double fragmentation;
+    uint64_t seed;
+    // Files per directory when the files are spread over a tree of subdirectories, or 0 to put every file in the root directory
+    uint32_t width;
+};
+
+// What diskmkfs actually built
+struct mkfs_report_t
+{
+    int total_files;
+    int total_dirs;
+    uint32_t data_blocks;
+    uint32_t allocated_blocks;
+    // Places where a chain jumps to a block other than the physically next one
+    uint32_t discontinuities;
+    uint32_t largest_file;
+    // Path of the largest file relative to the root
+    char largest_name[PATH_MAX];
+};
+
+// xorshift64* generator, so images are reproducible from their seed
+uint64_t mkfs_random(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717ull;
+}
+
+// Uniform random number in [0, 1)
+double mkfs_uniform(uint64_t *state)
+{
+    return (mkfs_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Find the first free block at or after from, wrapping around to the first data block
+uint32_t mkfs_next_free(const uint8_t *fat, uint32_t from, uint32_t first_data, uint32_t block_count)
+{
+    for (uint32_t b = from < first_data || from >= block_count ? first_data : from;; b = b + 1 < block_count ? b + 1 : first_data)
+        if (fat_entry(fat, b) == 0)
+            return b;
+}
+
+// Write a FAT entry in disk byte order
+void fat_set(uint8_t *fat, uint32_t block, uint32_t val)
+{
+    val = htonl(val);
+    memcpy(fat + (size_t)block * 4, &val, 4);
+}
+
+// Where diskmkfs is in laying out a new image
+struct mkfs_layout_t
+{
+    uint8_t *address;
+    uint8_t *fat;
+    struct mkfs_options_t *options;
+    struct mkfs_report_t *report;
+    uint32_t first_data;
+    // Block after the last one handed out, where the next contiguous block is looked for
+    uint32_t cursor;
+    uint64_t state;
+};
+
+// Allocate a chain of blocks front to back, jumping to a random free block as often as the fragmentation level asks; each block is recorded in blocks unless it is NULL, and filled with letters starting at fill unless it is negative. Returns the first block
+uint32_t mkfs_chain(struct mkfs_layout_t *layout, uint32_t total_blocks, uint32_t *blocks, int fill)
+{
+    uint32_t size = layout->options->block_size;
+    uint32_t first = 0xFFFFFFFF, previous = 0xFFFFFFFF;
+    for (uint32_t i = 0; i < total_blocks; i++)
+    {
+        uint32_t from = mkfs_uniform(&layout->state) < layout->options->fragmentation ? layout->first_data + mkfs_random(&layout->state) % layout->report->data_blocks
+                                                                                      : layout->cursor;
+        uint32_t block = mkfs_next_free(layout->fat, from, layout->first_data, layout->options->block_count);
+        fat_set(layout->fat, block, 0xFFFFFFFF);
+        if (previous == 0xFFFFFFFF)
+            first = block;
+        else
+        {
+            fat_set(layout->fat, previous, block);
+            layout->report->discontinuities += block != previous + 1;
+        }
+        if (fill >= 0)
+            memset(layout->address + (size_t)block * size, 'a' + (fill + i) % 26, size);
+        if (blocks != NULL)
+            blocks[i] = block;
+        previous = block;
+        layout->cursor = block + 1;
+    }
+    layout->report->allocated_blocks += total_blocks;
+    return first;
+}
+
+// Return a slot of a directory whose blocks are listed in blocks
+struct dir_entry_t *mkfs_slot(uint8_t *address, uint32_t size, const uint32_t *blocks, uint32_t slot)
+{
+    size_t offset = (size_t)slot * sizeof(struct dir_entry_t);
+    return (struct dir_entry_t *)(address + (size_t)blocks[offset / size] * size + offset % size);
+}
+
+// Write the path of a directory of the tree, numbered breadth first from the root, followed by a "/" unless it is the root
+void mkfs_path(uint32_t dir, uint32_t width, char *path, size_t length)
+{
+    if (dir == 0)
+    {
+        path[0] = '\0';
+        return;
+    }
+    mkfs_path((dir - 1) / width, width, path, length);
+    size_t used = strlen(path);
+    snprintf(path + used, length - used, "dir%06u/", dir);
+}
+
+// Create a new image at path and fill it with synthetic files; returns -1 if the image could not be created
+int mkfs_create(const char *path, struct mkfs_options_t *options, struct mkfs_report_t *report)
+{
+    uint32_t size = options->block_size;
+    uint32_t fat_blocks = ((uint64_t)options->block_count * 4 + size - 1) / size;
+    memset(report, 0, sizeof(*report));
+
+    // In a tree every directory holds up to width files followed by up to width subdirectories
+    uint32_t width = options->width;
+    uint32_t dir_blocks = ((uint64_t)width * 2 * sizeof(struct dir_entry_t) + size - 1) / size;
+
+    // Give the root directory room for the files the fill ratio implies plus one spare block, or for one directory's worth of entries in a tree
+    uint32_t root_blocks = options->root_blocks;
+    if (root_blocks == 0 && width > 0)
+    {
+        root_blocks = dir_blocks;
+        if (root_blocks > (options->block_count - 1 - fat_blocks) / 4)
+            root_blocks = (options->block_count - 1 - fat_blocks) / 4;
+    }
+    else if (root_blocks == 0)
+    {
+        uint64_t data_bytes = (uint64_t)(options->block_count - 1 - fat_blocks) * size;
+        uint64_t expected_files = data_bytes * options->fill / (options->mean_size > 0 ? options->mean_size : 1) + 1;
+        root_blocks = expected_files * sizeof(struct dir_entry_t) / size + 1;
+        if (root_blocks > (options->block_count - 1 - fat_blocks) / 4)
+            root_blocks = (options->block_count - 1 - fat_blocks) / 4;
+    }
+    uint32_t first_data = 1 + fat_blocks + root_blocks;
+    if (root_blocks == 0 || first_data >= options->block_count)
+    {
+        printf("Error: %u blocks of %u bytes leave no room for data\n", options->block_count, size);
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        perror("Error at fd");
+        return -1;
+    }
+    // A checksum table left beside an older image of the same name no longer describes it
+    char sums_path[PATH_MAX + 8];
+    snprintf(sums_path, sizeof(sums_path), "%s.crc", path);
+    unlink(sums_path);
+    size_t image_size = (size_t)options->block_count * size;
+    if (ftruncate(fd, image_size) == -1)
+    {
+        perror("Error at ftruncate");
+        close(fd);
+        return -1;
+    }
+    uint8_t *address = mmap(NULL, image_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == (void *)-1)
+    {
+        perror("Error at address");
+        close(fd);
+        return -1;
+    }
+
+    // The super block sits in block 0, followed by the FAT and the root directory
+    struct superblock_t *sb = (struct superblock_t *)address;
+    memcpy(sb->fs_id, "CSC360FS", 8);
+    sb->block_size = htons(size);
+    sb->file_system_block_count = htonl(options->block_count);
+    sb->fat_start_block = htonl(1);
+    sb->fat_block_count = htonl(fat_blocks);
+    sb->root_dir_start_block = htonl(1 + fat_blocks);
+    sb->root_dir_block_count = htonl(root_blocks);
+
+    // The super block and FAT are reserved, and the root directory is an allocated chain of its own
+    uint8_t *fat = address + size;
+    for (uint32_t b = 0; b < 1 + fat_blocks; b++)
+        fat_set(fat, b, 1);
+    for (uint32_t b = 1 + fat_blocks; b < first_data; b++)
+        fat_set(fat, b, b + 1 < first_data ? b + 1 : 0xFFFFFFFF);
+
+    // Every file gets the same timestamps
+    time_t rawtime;
+    time(&rawtime);
+    struct tm *info = localtime(&rawtime);
+    struct dir_entry_timedate_t stamp = {htons(info->tm_year + 1900), info->tm_mon + 1, info->tm_mday, info->tm_hour, info->tm_min, info->tm_sec};
+
+    struct dir_entry_t *entries = (struct dir_entry_t *)(address + (size_t)(1 + fat_blocks) * size);
+    uint32_t total_entries = (size_t)root_blocks * size / sizeof(struct dir_entry_t);
+    report->data_blocks = options->block_count - first_data;
+    uint32_t target = report->data_blocks * options->fill;
+    struct mkfs_layout_t layout = {address, fat, options, report, first_data, first_data, options->seed != 0 ? options->seed : 1};
+
+    // Blocks of every subdirectory made so far, dir_blocks apiece, numbered breadth first so a directory's parent always comes before it
+    uint32_t *dir_list = NULL;
+    uint32_t total_dirs = 1;
+
+    while (report->allocated_blocks < target)
+    {
+        // A flat image puts every file in the root directory, a tree puts file k in directory k / width
+        int file = report->total_files;
+        uint32_t dir = width == 0 ? 0 : file / width;
+        uint32_t slot = width == 0 ? file : file % width;
+        if (dir == 0 && slot >= total_entries)
+            break;
+
+        if (dir == total_dirs)
+        {
+            // Make the next directory in its parent, as long as its blocks still leave room for a file
+            uint32_t parent = (dir - 1) / width;
+            uint32_t parent_slot = width + (dir - 1) % width;
+            if ((parent == 0 && parent_slot >= total_entries) || report->allocated_blocks + dir_blocks >= target)
+                break;
+            dir_list = realloc(dir_list, (size_t)dir * dir_blocks * sizeof(*dir_list));
+            uint32_t first = mkfs_chain(&layout, dir_blocks, dir_list + (size_t)(dir - 1) * dir_blocks, -1);
+
+            struct dir_entry_t *entry = parent == 0 ? &entries[parent_slot] : mkfs_slot(address, size, dir_list + (size_t)(parent - 1) * dir_blocks, parent_slot);
+            entry->status = 5;
+            entry->starting_block = htonl(first);
+            entry->block_count = htonl(dir_blocks);
+            entry->size = htonl(dir_blocks * size);
+            entry->create_time = stamp;
+            entry->modify_time = stamp;
+            snprintf((char *)entry->filename, sizeof(entry->filename), "dir%06u", dir);
+            total_dirs++;
+            report->total_dirs++;
+        }
+
+        // Draw the next file size from the chosen distribution
+        double mean = options->mean_size;
+        double drawn = options->distribution == 'u' ? 1 + mkfs_uniform(&layout.state) * (2 * mean - 1) : options->distribution == 'e' ? -mean * log1p(-mkfs_uniform(&layout.state))
+                                                                                                                                     : mean;
+        uint64_t file_size = drawn < 1 ? 1 : drawn;
+        uint32_t blocks = (file_size + size - 1) / size;
+        if (blocks > target - report->allocated_blocks)
+        {
+            blocks = target - report->allocated_blocks;
+            file_size = (uint64_t)blocks * size;
+        }
+        if (file_size > UINT32_MAX)
+        {
+            file_size = UINT32_MAX - UINT32_MAX % size;
+            blocks = file_size / size;
+        }
+        uint32_t first = mkfs_chain(&layout, blocks, NULL, file);
+
+        struct dir_entry_t *entry = dir == 0 ? &entries[slot] : mkfs_slot(address, size, dir_list + (size_t)(dir - 1) * dir_blocks, slot);
+        entry->status = 3;
+        entry->starting_block = htonl(first);
+        entry->block_count = htonl(blocks);
+        entry->size = htonl(file_size);
+        entry->create_time = stamp;
+        entry->modify_time = stamp;
+        snprintf((char *)entry->filename, sizeof(entry->filename), "file%06d.bin", file);
+        if (file_size > report->largest_file)
+        {
+            report->largest_file = file_size;
+            mkfs_path(dir, width, report->largest_name, sizeof(report->largest_name));
+            size_t used = strlen(report->largest_name);
+            snprintf(report->largest_name + used, sizeof(report->largest_name) - used, "%s", (char *)entry->filename);
+        }
+        report->total_files++;
+    }
+    free(dir_list);
+
+    msync(address, image_size, MS_SYNC);
+    munmap(address, image_size);
+    close(fd);
+    return 0;
+}
+
+// Parse a size with an optional K, M or G suffix
+uint64_t parse_size(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    uint64_t scale = *end == 'K' || *end == 'k' ? 1ull << 10 : *end == 'M' || *end == 'm' ? 1ull << 20 : *end == 'G' || *end == 'g' ? 1ull << 30 : 1;
+    return value * scale;
+}
+
+// Latency samples and resource use gathered for one tool on one image
+struct bench_result_t
+{
+    double latencies[1024];
+    int runs;
+    int failures;
+    long minflt;
+    long majflt;
+};
+
+// Run one tool to completion with its output discarded, recording its wall time and page faults
+void bench_spawn(char *const args[], struct bench_result_t *result)
+{
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        dup2(null, STDERR_FILENO);
+        execv(args[0], args);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage = {0};
+    if (pid == -1 || wait4(pid, &status, 0, &usage) == -1)
+        status = -1;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if (result->runs < (int)(sizeof(result->latencies) / sizeof(result->latencies[0])))
+        result->latencies[result->runs++] = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1000000000.0;
+    result->minflt += usage.ru_minflt;
+    result->majflt += usage.ru_majflt;
+    if (status == -1 || WIFEXITED(status) == false || WEXITSTATUS(status) != 0)
+        result->failures++;
+}
+
+// Order latencies from fastest to slowest
+int compare_latency(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Latency below which the given fraction of the runs finished
+double bench_percentile(struct bench_result_t *result, double fraction)
+{
+    int rank = fraction * result->runs + 0.999999;
+    return result->latencies[rank > 0 ? rank - 1 : 0];
+}
+
+// Print one row of the benchmark table; bytes is the data each run moved, or 0 for tools that only read metadata
+void bench_report(const char *image, const char *tool, struct bench_result_t *result, uint64_t bytes)
+{
+    qsort(result->latencies, result->runs, sizeof(result->latencies[0]), compare_latency);
+    double p50 = bench_percentile(result, 0.50);
+    printf("%-8s %-9s %4d %9.3f %9.3f %9.3f ", image, tool, result->runs, p50 * 1000, bench_percentile(result, 0.90) * 1000, bench_percentile(result, 0.99) * 1000);
+    if (bytes > 0)
+        printf("%9.1f ", bytes / p50 / (1 << 20));
+    else
+        printf("%9s ", "-");
+    printf("%10ld %10ld %6d\n", result->minflt / (result->runs > 0 ? result->runs : 1), result->majflt / (result->runs > 0 ? result->runs : 1), result->failures);
+}
+
+// Seconds on the monotonic clock, for timing work done inside this process
+double bench_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+// An image that exists only as its super block and FAT, for benchmarks of the metadata code that never read file data
+struct bench_fat_t
+{
+    uint8_t *image;
+    uint8_t *fat;
+    // Size the image would have on disk, which the FAT code uses to bound the usable blocks
+    size_t image_size;
+    uint32_t block_count;
+    uint32_t first_data;
+    uint32_t free_blocks;
+};
+
+// Draw a file length in blocks: mostly small files, some medium ones and a few large ones scaled to the data area
+uint32_t bench_file_blocks(uint64_t *state, uint32_t data_blocks)
+{
+    uint32_t large = data_blocks / 64 > 256 ? data_blocks / 64 : 256;
+    double pick = mkfs_uniform(state);
+    if (pick < 0.6)
+        return 1 + mkfs_random(state) % 8;
+    if (pick < 0.9)
+        return 9 + mkfs_random(state) % 120;
+    return 129 + mkfs_random(state) % (large - 128);
+}
+
+// Lay out contiguous files of mixed lengths over the first fill of the data area and leave about half of them unwritten, so the free space is scattered in holes of every size
+void bench_fat_create(struct bench_fat_t *bench, uint32_t block_size, uint32_t block_count, double fill, uint64_t *state)
+{
+    uint32_t fat_blocks = ((uint64_t)block_count * 4 + block_size - 1) / block_size;
+    bench->image_size = (size_t)block_count * block_size;
+    bench->block_count = block_count;
+    bench->first_data = 1 + fat_blocks;
+    bench->image = calloc((size_t)(1 + fat_blocks) * block_size, 1);
+    bench->fat = bench->image + block_size;
+
+    struct superblock_t *sb = (struct superblock_t *)bench->image;
+    memcpy(sb->fs_id, "CSC360FS", 8);
+    sb->block_size = htons(block_size);
+    sb->file_system_block_count = htonl(block_count);
+    sb->fat_start_block = htonl(1);
+    sb->fat_block_count = htonl(fat_blocks);
+    for (uint32_t b = 0; b < bench->first_data; b++)
+        fat_set(bench->fat, b, 1);
+
+    uint32_t data_blocks = block_count - bench->first_data;
+    uint32_t end = bench->first_data + data_blocks * fill;
+    for (uint32_t b = bench->first_data; b < end;)
+    {
+        uint32_t length = bench_file_blocks(state, data_blocks);
+        if (length > end - b)
+            length = end - b;
+        if (mkfs_uniform(state) < 0.5)
+            for (uint32_t i = 0; i < length; i++)
+                fat_set(bench->fat, b + i, i + 1 < length ? b + i + 1 : 0xFFFFFFFF);
+        b += length;
+    }
+
+    bench->free_blocks = 0;
+    for (uint32_t b = bench->first_data; b < block_count; b++)
+        bench->free_blocks += fat_entry(bench->fat, b) == 0;
+}
+
+// Release the memory held by a benchmark image
+void bench_fat_destroy(struct bench_fat_t *bench)
+{
+    free(bench->image);
+}
+
+// The allocator diskput used before the free extent index: scan the FAT from its start and chain the first need free entries in order. Returns the number of runs the chain is made of
+int bench_alloc_scan(uint8_t *fat, uint32_t block_count, uint32_t need)
+{
+    uint32_t previous = 0xFFFFFFFF, claimed = 0;
+    int runs = 0;
+    for (uint32_t b = 0; b < block_count && claimed < need; b++)
+    {
+        if (fat_entry(fat, b) != 0)
+            continue;
+        if (previous != 0xFFFFFFFF)
+            fat_set(fat, previous, b);
+        runs += previous == 0xFFFFFFFF || b != previous + 1;
+        fat_set(fat, b, 0xFFFFFFFF);
+        previous = b;
+        claimed++;
+    }
+    return runs;
+}
+
+// Claim need blocks from the free extent index and chain its runs the way diskput does. Returns the number of runs the chain is made of
+int bench_alloc_index(struct free_index_t *index, uint8_t *fat, uint32_t need)
+{
+    struct extent_t *extents;
+    int total_extents = free_index_alloc(index, need, &extents);
+    uint32_t previous = 0xFFFFFFFF;
+    for (int e = 0; e < total_extents; e++)
+        for (uint32_t b = extents[e].start; b < extents[e].start + extents[e].length; b++)
+        {
+            if (previous != 0xFFFFFFFF)
+                fat_set(fat, previous, b);
+            fat_set(fat, b, 0xFFFFFFFF);
+            previous = b;
+        }
+    free(extents);
+    return total_extents;
+}
+
+// Allocate the same sequence of mixed size files with the old FAT scan and with the free extent index, on an image the size of test.dmg and on a 1 GiB image
+void bench_alloc(void)
+{
+    struct
+    {
+        char *label;
+        uint32_t block_size;
+        uint32_t block_count;
+    } images[] = {{"test.dmg", 512, 6400}, {"1G", 4096, 262144}};
+
+    printf("%-8s %-9s %6s %9s %10s %12s\n", "image", "allocator", "files", "build ms", "us/alloc", "extents/file");
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        uint64_t state = 1;
+        struct bench_fat_t bench;
+        bench_fat_create(&bench, images[i].block_size, images[i].block_count, 0.7, &state);
+        size_t fat_bytes = (size_t)bench.block_count * 4;
+        uint8_t *original = malloc(fat_bytes);
+        memcpy(original, bench.fat, fat_bytes);
+
+        // Draw up to 1000 files that together fit in nine tenths of the free space, so neither allocator runs out
+        uint32_t lengths[1000];
+        int total_files = 0;
+        uint64_t total_blocks = 0;
+        while (total_files < 1000)
+        {
+            uint32_t length = bench_file_blocks(&state, bench.block_count - bench.first_data);
+            if (total_blocks + length > bench.free_blocks * 0.9)
+                break;
+            lengths[total_files++] = length;
+            total_blocks += length;
+        }
+
+        uint64_t extents = 0;
+        double begin = bench_now();
+        for (int f = 0; f < total_files; f++)
+            extents += bench_alloc_scan(bench.fat, bench.block_count, lengths[f]);
+        double elapsed = bench_now() - begin;
+        printf("%-8s %-9s %6d %9s %10.3f %12.2f\n", images[i].label, "scan", total_files, "-", elapsed * 1000000 / total_files, (double)extents / total_files);
+
+        // The index is built once per image open, so its cost is reported apart from the allocations
+        memcpy(bench.fat, original, fat_bytes);
+        struct free_index_t index;
+        begin = bench_now();
+        free_index_build(&index, bench.image, bench.image_size);
+        double build = bench_now() - begin;
+        extents = 0;
+        begin = bench_now();
+        for (int f = 0; f < total_files; f++)
+            extents += bench_alloc_index(&index, bench.fat, lengths[f]);
+        elapsed = bench_now() - begin;
+        printf("%-8s %-9s %6d %9.3f %10.3f %12.2f\n", images[i].label, "index", total_files, build * 1000, elapsed * 1000000 / total_files, (double)extents / total_files);
+
+        free_index_destroy(&index);
+        free(original);
+        bench_fat_destroy(&bench);
+    }
+}
+
+// Time one census kernel over repeated passes of a FAT, leaving the counts of a single pass in census; returns the seconds per pass
+double bench_census_kernel(void (*kernel)(const uint8_t *, size_t, struct fat_census_t *), const uint8_t *fat, size_t entries, int passes, struct fat_census_t *census)
+{
+    double begin = bench_now();
+    for (int p = 0; p < passes; p++)
+    {
+        memset(census, 0, sizeof(*census));
+        kernel(fat, entries, census);
+    }
+    return (bench_now() - begin) / passes;
+}
+
+// Time the scalar, SSE2 and AVX2 census kernels on synthetic FATs of 64K to 4M entries, exiting in error if any two disagree on the counts
+void bench_census(void)
+{
+    printf("%-8s %-7s %7s %9s %8s\n", "entries", "kernel", "passes", "us/pass", "speed-up");
+    for (size_t entries = 64 << 10; entries <= 4 << 20; entries *= 4)
+    {
+        // A mix of free, reserved and allocated entries in disk byte order, with the allocated ones holding arbitrary links
+        uint64_t state = 1;
+        uint8_t *fat = malloc(entries * 4);
+        for (size_t i = 0; i < entries; i++)
+        {
+            double pick = mkfs_uniform(&state);
+            fat_set(fat, i, pick < 0.4 ? 0 : pick < 0.45 ? 1 : 2 + mkfs_random(&state) % 0xFFFFFFFE);
+        }
+
+        // Scan about 64M entries per kernel so the smaller FATs are timed over enough passes
+        int passes = (64 << 20) / entries;
+        char label[16];
+        snprintf(label, sizeof(label), "%zuK", entries >> 10);
+
+        struct fat_census_t scalar, census;
+        double base = bench_census_kernel(fat_census_scalar, fat, entries, passes, &scalar);
+        printf("%-8s %-7s %7d %9.1f %7.2fx\n", label, "scalar", passes, base * 1000000, 1.0);
+#if defined(__x86_64__) || defined(__i386__)
+        struct
+        {
+            char *name;
+            void (*kernel)(const uint8_t *, size_t, struct fat_census_t *);
+            bool supported;
+        } kernels[] = {{"sse2", fat_census_sse2, __builtin_cpu_supports("sse2")}, {"avx2", fat_census_avx2, __builtin_cpu_supports("avx2")}};
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+        {
+            if (kernels[k].supported == false)
+            {
+                printf("%-8s %-7s %7s %9s %8s\n", label, kernels[k].name, "-", "-", "-");
+                continue;
+            }
+            double elapsed = bench_census_kernel(kernels[k].kernel, fat, entries, passes, &census);
+            if (census.free != scalar.free || census.reserved != scalar.reserved || census.allocated != scalar.allocated)
+            {
+                printf("Error: the %s census of %zu entries counted %lu free, %lu reserved and %lu allocated, the scalar one %lu, %lu and %lu\n", kernels[k].name,
+                       entries, census.free, census.reserved, census.allocated, scalar.free, scalar.reserved, scalar.allocated);
+                exit(1);
+            }
+            printf("%-8s %-7s %7d %9.1f %7.2fx\n", label, kernels[k].name, passes, elapsed * 1000000, base / elapsed);
+        }
+#endif
+        free(fat);
+    }
+}
+
+// The loop readers followed chains with before the shared walker: take next links until the end marker, checking only that each block is in range. Returns the blocks walked
+uint64_t bench_walk_links(const uint8_t *fat, uint32_t block_count, uint32_t start)
+{
+    uint64_t blocks = 0;
+    for (uint32_t block = start; block != 0xFFFFFFFF && block < block_count; block = fat_entry(fat, block))
+        blocks++;
+    return blocks;
+}
+
+// Follow the same chain with the bounded walker, as the readers now do. Returns the blocks walked
+uint64_t bench_walk_chain(const uint8_t *fat, uint32_t block_count, uint32_t start, uint32_t limit)
+{
+    struct chain_walk_t walk;
+    chain_walk_begin(&walk, fat, block_count, start, limit);
+    uint64_t blocks = 0;
+    uint32_t block;
+    while (chain_walk_next(&walk, &block) == true)
+        blocks++;
+    return blocks;
+}
+
+// Walk every file of an image whose files each have their blocks spread at random over the whole disk, with the old link loop and with chain_walk_next
+void bench_walk(void)
+{
+    struct
+    {
+        char *label;
+        uint32_t block_size;
+        uint32_t block_count;
+    } images[] = {{"1G", 4096, 262144}, {"16G", 4096, 4194304}};
+
+    printf("%-8s %-7s %7s %7s %10s %12s\n", "image", "walker", "files", "passes", "ms/pass", "Mblocks/s");
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++)
+    {
+        uint64_t state = 1;
+        struct bench_fat_t bench;
+        bench_fat_create(&bench, images[i].block_size, images[i].block_count, 0, &state);
+
+        // Shuffle the data blocks, then cut the shuffled order into files of mixed lengths, so consecutive blocks of a file lie anywhere on the disk
+        uint32_t data_blocks = bench.block_count - bench.first_data;
+        uint32_t *order = malloc(data_blocks * sizeof(*order));
+        for (uint32_t b = 0; b < data_blocks; b++)
+            order[b] = bench.first_data + b;
+        for (uint32_t b = data_blocks - 1; b > 0; b--)
+        {
+            uint32_t other = mkfs_random(&state) % (b + 1), swap = order[b];
+            order[b] = order[other];
+            order[other] = swap;
+        }
+        struct extent_t *files = NULL;
+        int total_files = 0, capacity = 0;
+        for (uint32_t b = 0; b < data_blocks;)
+        {
+            uint32_t length = bench_file_blocks(&state, data_blocks);
+            if (length > data_blocks - b)
+                length = data_blocks - b;
+            for (uint32_t f = 0; f < length; f++)
+                fat_set(bench.fat, order[b + f], f + 1 < length ? order[b + f + 1] : 0xFFFFFFFF);
+            if (total_files == capacity)
+            {
+                capacity = capacity == 0 ? 1024 : capacity * 2;
+                files = realloc(files, capacity * sizeof(*files));
+            }
+            // Each file is recorded as its first block and its length
+            files[total_files++] = (struct extent_t){order[b], length};
+            b += length;
+        }
+        free(order);
+
+        // Walk about 16M blocks with each loop so the smaller image is timed over enough passes
+        int passes = (16 << 20) / data_blocks;
+        uint64_t walked[2] = {0, 0};
+        double elapsed[2];
+        for (int w = 0; w < 2; w++)
+        {
+            double begin = bench_now();
+            for (int p = 0; p < passes; p++)
+                for (int f = 0; f < total_files; f++)
+                    walked[w] += w == 0 ? bench_walk_links(bench.fat, bench.block_count, files[f].start)
+                                        : bench_walk_chain(bench.fat, bench.block_count, files[f].start, files[f].length);
+            elapsed[w] = bench_now() - begin;
+        }
+        if (walked[0] != walked[1] || walked[0] != (uint64_t)data_blocks * passes)
+        {
+            printf("Error: the walkers covered %llu and %llu blocks of %llu\n", (unsigned long long)walked[0], (unsigned long long)walked[1],
+                   (unsigned long long)data_blocks * passes);
+            exit(1);
+        }
+        printf("%-8s %-7s %7d %7d %10.3f %12.1f\n", images[i].label, "links", total_files, passes, elapsed[0] * 1000 / passes, walked[0] / elapsed[0] / 1000000);
+        printf("%-8s %-7s %7d %7d %10.3f %12.1f\n", images[i].label, "walker", total_files, passes, elapsed[1] * 1000 / passes, walked[1] / elapsed[1] / 1000000);
+
+        free(files);
+        bench_fat_destroy(&bench);
+    }
+}
+
+void diskinfo(int argc, char *argv[])
+{
+    // Check if the user input is valid
+    if (argc != 2)
+    {
+        printf("Expected: ./diskinfo <disk image>\n");
+        exit(1);
+    }
+
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], false) == -1)
+        exit(1);
+    disk_info(&disk);
+    disk_close(&disk);
+}
+
+void disklist(int argc, char **argv)
+{
+    // The directory may be preceded by -R to list every directory below it as well
+    bool recursive = argc == 4 && strcmp(argv[2], "-R") == 0;
+    if ((argc != 3 && recursive == false) || argv[argc - 1][0] != 47)
+    {
+        printf("Expected: ./disklist <disk image> [-R] /<disk directory>\n");
+        exit(1);
+    }
+
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], false) == -1)
+        exit(1);
+    int result = disk_list(&disk, argv[argc - 1], recursive);
+    disk_close(&disk);
+    if (result == -1)
+        exit(1);
+}
+
+void diskget(int argc, char *argv[])
+{
+    // Extract many files in one process when given a local directory followed by file names or glob patterns
+    if (argc >= 5 && strcmp(argv[2], "-d") == 0)
+    {
+        for (int p = 4; p < argc; p++)
+        {
+            if (argv[p][0] != 47)
+            {
+                printf("Expected: ./diskget <disk image> -d <local directory> /<disk file or pattern> ...\n");
+                exit(1);
+            }
+        }
+
+        struct disk_t disk;
+        if (disk_open(&disk, argv[1], false) == -1)
+            exit(1);
+        int result = disk_get_batch(&disk, argv[3], argv + 4, argc - 4);
+        disk_close(&disk);
+        if (result == -1)
+            exit(1);
+        return;
+    }
+
+    if (argc != 4)
+    {
+        printf("Expected: ./diskget <disk image> /<disk file> <local file>\n");
+        printf("      or: ./diskget <disk image> -d <local directory> /<disk file or pattern> ...\n");
+        exit(1);
+    }
+
+    // If there is no "/" character in the appropriate position, exit in error and notify the user
+    if (argv[2][0] != 47 || argv[3][0] == 47)
+    {
+        printf("Expected: ./diskget <disk image> /<disk file> <local file>\n");
+        exit(1);
+    }
+
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], false) == -1)
+        exit(1);
+    // Strip the "/" character from the name of the file
+    int result = disk_get(&disk, argv[2] + 1, argv[3]);
+    disk_close(&disk);
+    if (result == -1)
+        exit(1);
+}
+
+void diskput(int argc, char *argv[])
+{
+    // With -s, a file identical to one already in the image shares its blocks
+    bool dedup = argc == 5 && strcmp(argv[2], "-s") == 0;
+    if ((argc != 4 && dedup == false) || argv[argc - 1][0] != 47)
+    {
+        printf("Expected: ./diskput <disk image> [-s] <local file> /<disk file>\n");
+        exit(1);
+    }
+
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], true) == -1)
+        exit(1);
+    // Strip the "/" character from the name of the file
+    int result = disk_put(&disk, argv[argc - 2], argv[argc - 1] + 1, dedup);
+    disk_close(&disk);
+    if (result == -1)
+        exit(1);
+}
+
+void diskfix(int argc, char *argv[])
+{
+    if ((argc != 2 && argc != 3) || (argc == 3 && strcmp(argv[2], "-r") != 0))
+    {
+        printf("Expected: ./diskfix <disk image> [-r]\n");
+        exit(1);
+    }
+
+    // Opening the image replays or discards whatever an interrupted commit left in the journal; a check that repairs nothing opens it read-only
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], argc == 3) == -1)
+        exit(1);
+    if (disk.recovered == 0)
+        printf("Journal: clean\n");
+
+    // Only repair in place when asked to, otherwise just report
+    int problems = disk_fix(&disk, argc == 3);
+    disk_close(&disk);
+    if (problems > 0)
+        exit(1);
+}
+
+void diskdefrag(int argc, char *argv[])
+{
+    if ((argc != 2 && argc != 3) || (argc == 3 && strcmp(argv[2], "-n") != 0))
+    {
+        printf("Expected: ./diskdefrag <disk image> [-n]\n");
+        exit(1);
+    }
+
+    // A dry run only reports what would move, so it opens the image read-only
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], argc == 2) == -1)
+        exit(1);
+    int result = disk_defrag(&disk, argc == 3);
+    disk_close(&disk);
+    if (result == -1)
+        exit(1);
+}
+
+void diskverify(int argc, char *argv[])
+{
+    if ((argc != 2 && argc != 3) || (argc == 3 && strcmp(argv[2], "-i") != 0))
+    {
+        printf("Expected: ./diskverify <disk image> [-i]\n");
+        exit(1);
+    }
+
+    // A scrub only reads, so it opens the image read-only; -i writes a new checksum table beside it
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], argc == 3) == -1)
+        exit(1);
+    int result = argc == 3 ? disk_sums_create(&disk) : disk_verify(&disk);
+    disk_close(&disk);
+    if (result != 0)
+        exit(1);
+}
+
+void diskmkfs(int argc, char *argv[])
+{
+    struct mkfs_options_t options = {512, 0, 0, 0, 64 << 10, 'e', 0, 1, 0};
+    bool valid = argc >= 2 && argv[1][0] != '-';
+
+    // Options follow the image name
+    optind = 2;
+    int option;
+    while (valid == true && (option = getopt(argc, argv, "n:b:e:f:s:d:g:r:w:")) != -1)
+    {
+        if (option == 'n')
+            options.block_count = strtoul(optarg, NULL, 10);
+        else if (option == 'b')
+            options.block_size = strtoul(optarg, NULL, 10);
+        else if (option == 'e')
+            options.root_blocks = strtoul(optarg, NULL, 10);
+        else if (option == 'f')
+            options.fill = atof(optarg);
+        else if (option == 's')
+            options.mean_size = parse_size(optarg);
+        else if (option == 'd')
+            options.distribution = optarg[0];
+        else if (option == 'g')
+            options.fragmentation = atof(optarg);
+        else if (option == 'r')
+            options.seed = strtoull(optarg, NULL, 10);
+        else if (option == 'w')
+            options.width = strtoul(optarg, NULL, 10);
+        else
+            valid = false;
+    }
+
+    // Block sizes must be powers of two that fit the super block's 16 bit field and hold whole directory entries
+    if (valid == false || optind != argc || options.block_count == 0 || options.block_size < 512 || options.block_size > 32768 ||
+        (options.block_size & (options.block_size - 1)) != 0 || options.fill < 0 || options.fill > 1 || options.fragmentation < 0 ||
+        options.fragmentation > 1 || strchr("fue", options.distribution) == NULL || options.width == 1 || options.width > 1u << 20)
+    {
+        printf("Expected: ./diskmkfs <disk image> -n <block count> [-b <block size>] [-e <root directory blocks>]\n");
+        printf("          [-f <fill ratio>] [-s <mean file size>] [-d fixed|uniform|exponential] [-g <fragmentation>] [-r <seed>]\n");
+        printf("          [-w <files per directory, spread over a tree of subdirectories>]\n");
+        exit(1);
+    }
+
+    struct mkfs_report_t report;
+    if (mkfs_create(argv[1], &options, &report) == -1)
+        exit(1);
+    printf("Created %s: %u blocks of %u bytes with %d files and %d subdirectories in %u of %u data blocks, %.1f%% of links discontiguous\n", argv[1],
+           options.block_count, options.block_size, report.total_files, report.total_dirs, report.allocated_blocks, report.data_blocks,
+           report.allocated_blocks > (uint32_t)(report.total_files + report.total_dirs)
+               ? 100.0 * report.discontinuities / (report.allocated_blocks - report.total_files - report.total_dirs)
+               : 0.0);
+}
+
+void diskbench(int argc, char *argv[])
+{
+    char *sizes = "4M,64M,512M", *mode = "tools";
+    int runs = 10;
+    uint32_t block_size = 4096, width = 0;
+    double fragmentation = 0.1, fill = 0.5;
+    bool valid = argc >= 2 && argv[1][0] != '-';
+
+    // Options follow the work directory
+    optind = 2;
+    int option;
+    while (valid == true && (option = getopt(argc, argv, "s:r:b:g:f:w:m:")) != -1)
+    {
+        if (option == 'm')
+            mode = optarg;
+        else if (option == 's')
+            sizes = optarg;
+        else if (option == 'r')
+            runs = atoi(optarg);
+        else if (option == 'b')
+            block_size = strtoul(optarg, NULL, 10);
+        else if (option == 'g')
+            fragmentation = atof(optarg);
+        else if (option == 'f')
+            fill = atof(optarg);
+        else if (option == 'w')
+            width = strtoul(optarg, NULL, 10);
+        else
+            valid = false;
+    }
+    if (valid == false || optind != argc || runs < 1 || runs > 1024 || block_size < 512 || block_size > 32768 || (block_size & (block_size - 1)) != 0 ||
+        width == 1 || width > 1u << 20 || (strcmp(mode, "tools") != 0 && strcmp(mode, "alloc") != 0 && strcmp(mode, "census") != 0 && strcmp(mode, "walk") != 0 &&
+         strcmp(mode, "all") != 0))
+    {
+        printf("Expected: ./diskbench <work directory> [-m tools|alloc|census|walk|all] [-s <image sizes, e.g. 4M,64M,1G>] [-r <runs>] [-b <block size>] [-g <fragmentation>]\n");
+        printf("          [-f <fill ratio>] [-w <files per directory, spread over a tree of subdirectories>]\n");
+        exit(1);
+    }
+
+    // The allocator, census and walker comparisons run on images held in memory, so they need neither the tools nor the work directory; all runs every table in turn
+    bool all = strcmp(mode, "all") == 0;
+    if (all == true || strcmp(mode, "census") == 0)
+    {
+        bench_census();
+        if (all == true)
+            printf("\n");
+    }
+    if (all == true || strcmp(mode, "alloc") == 0)
+    {
+        bench_alloc();
+        if (all == true)
+            printf("\n");
+    }
+    if (all == true || strcmp(mode, "walk") == 0)
+    {
+        bench_walk();
+        if (all == true)
+            printf("\n");
+    }
+    if (all == false && strcmp(mode, "tools") != 0)
+        return;
+
+    // The tools are expected next to this binary
+    char tools[PATH_MAX];
+    if (realpath(argv[0], tools) == NULL)
+    {
+        perror("Error at realpath");
+        exit(1);
+    }
+    *strrchr(tools, '/') = '\0';
+
+    // Work inside the directory so diskget is handed a relative local file as it expects
+    if (chdir(argv[1]) == -1)
+    {
+        perror("Error at chdir");
+        exit(1);
+    }
+
+    printf("%-8s %-9s %4s %9s %9s %9s %9s %10s %10s %6s\n", "image", "tool", "runs", "p50 ms", "p90 ms", "p99 ms", "MB/s", "minflt/run", "majflt/run", "failed");
+
+    char *list = strdup(sizes);
+    for (char *label = strtok(list, ","); label != NULL; label = strtok(NULL, ","))
+    {
+        // Build a fresh image of this size with files averaging 1/256 of it
+        uint64_t image_size = parse_size(label);
+        struct mkfs_options_t options = {block_size, image_size / block_size, 0, fill, image_size / 256, 'e', fragmentation, 1, width};
+        // A tree fills its root directory, so leave room there for the files diskput adds
+        if (width > 0)
+            options.root_blocks = ((uint64_t)width * 2 + runs) * sizeof(struct dir_entry_t) / block_size + 1;
+        if (options.mean_size < block_size)
+            options.mean_size = block_size;
+
+        char image[PATH_MAX], local[PATH_MAX], out[PATH_MAX];
+        snprintf(image, sizeof(image), "bench-%s.dmg", label);
+        snprintf(local, sizeof(local), "bench-%s.put", label);
+        snprintf(out, sizeof(out), "bench-%s.get", label);
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC, &begin);
+        struct mkfs_report_t report;
+        if (options.block_count < 16 || mkfs_create(image, &options, &report) == -1)
+        {
+            printf("Error: could not build a %s image\n", label);
+            continue;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        fprintf(stderr, "Built %s/%s: %d files, %u of %u data blocks, largest /%s of %u bytes, in %.2f s\n", argv[1], image, report.total_files, report.allocated_blocks,
+                report.data_blocks, report.largest_name, report.largest_file, (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1000000000.0);
+
+        // A local file the size of an average image file for diskput to place
+        int fd = open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        uint8_t *data = calloc(1, options.mean_size);
+        write_all(fd, data, options.mean_size);
+        free(data);
+        close(fd);
+
+        char info[PATH_MAX + 16], list_tool[PATH_MAX + 16], get[PATH_MAX + 16], put[PATH_MAX + 16], fix[PATH_MAX + 16], name[64], largest[PATH_MAX + 1];
+        snprintf(info, sizeof(info), "%s/diskinfo", tools);
+        snprintf(list_tool, sizeof(list_tool), "%s/disklist", tools);
+        snprintf(get, sizeof(get), "%s/diskget", tools);
+        snprintf(put, sizeof(put), "%s/diskput", tools);
+        snprintf(fix, sizeof(fix), "%s/diskfix", tools);
+        snprintf(largest, sizeof(largest), "/%s", report.largest_name);
+
+        struct bench_result_t results[5] = {0};
+        for (int r = 0; r < runs; r++)
+        {
+            bench_spawn((char *[]){info, image, NULL}, &results[0]);
+            bench_spawn((char *[]){list_tool, image, "/", NULL}, &results[1]);
+            bench_spawn((char *[]){get, image, largest, out, NULL}, &results[2]);
+            bench_spawn((char *[]){fix, image, NULL}, &results[3]);
+            snprintf(name, sizeof(name), "/put%d", r);
+            bench_spawn((char *[]){put, image, local, name, NULL}, &results[4]);
+        }
+        bench_report(label, "diskinfo", &results[0], 0);
+        bench_report(label, "disklist", &results[1], 0);
+        bench_report(label, "diskget", &results[2], report.largest_file);
+        bench_report(label, "diskfix", &results[3], 0);
+        bench_report(label, "diskput", &results[4], options.mean_size);
+
+        unlink(image);
+        unlink(local);
+        unlink(out);
+    }
+    free(list);
+}
+
+// Run a single disktool command line against the open image; returns -1 if the command failed
+int disktool_command(struct disk_t *disk, char *line)
+{
+    // Split the line into whitespace separated words
+    char *words[64];
+    int total_words = 0;
+    for (char *word = strtok(line, " \t\r\n"); word != NULL && total_words < 64; word = strtok(NULL, " \t\r\n"))
+        words[total_words++] = word;
+
+    // Ignore blank lines and comments
+    if (total_words == 0 || words[0][0] == '#')
+        return 0;
+
+    // Consecutive puts share one commit; any other command commits them first so it sees the image as they left it
+    if (strcmp(words[0], "put") != 0 && disk_commit(disk) == -1)
+        return -1;
+    if (strcmp(words[0], "sync") == 0 && total_words == 1)
+        return 0;
+
+    if (strcmp(words[0], "info") == 0 && total_words == 1)
+    {
+        disk_info(disk);
+        return 0;
+    }
+    if (strcmp(words[0], "list") == 0 && total_words == 2 && words[1][0] == 47)
+        return disk_list(disk, words[1], false);
+    if (strcmp(words[0], "list") == 0 && total_words == 3 && strcmp(words[1], "-R") == 0 && words[2][0] == 47)
+        return disk_list(disk, words[2], true);
+    if (strcmp(words[0], "get") == 0 && total_words >= 4 && strcmp(words[1], "-d") == 0)
+        return disk_get_batch(disk, words[2], words + 3, total_words - 3);
+    if (strcmp(words[0], "get") == 0 && total_words == 3 && words[1][0] == 47 && words[2][0] != 47)
+        return disk_get(disk, words[1] + 1, words[2]);
+    if (strcmp(words[0], "put") == 0 && total_words == 3 && words[2][0] == 47)
+        return disk_put(disk, words[1], words[2] + 1, false);
+    if (strcmp(words[0], "put") == 0 && total_words == 4 && strcmp(words[1], "-s") == 0 && words[3][0] == 47)
+        return disk_put(disk, words[2], words[3] + 1, true);
+    if (strcmp(words[0], "fix") == 0 && (total_words == 1 || (total_words == 2 && strcmp(words[1], "-r") == 0)))
+        return disk_fix(disk, total_words == 2) > 0 ? -1 : 0;
+    if (strcmp(words[0], "verify") == 0 && total_words == 1)
+        return disk_verify(disk) != 0 ? -1 : 0;
+    if (strcmp(words[0], "verify") == 0 && total_words == 2 && strcmp(words[1], "-i") == 0)
+        return disk_sums_create(disk);
+    if (strcmp(words[0], "defrag") == 0 && (total_words == 1 || (total_words == 2 && strcmp(words[1], "-n") == 0)))
+        return disk_defrag(disk, total_words == 2);
+
+    printf("Expected one of:\n");
+    printf("  info\n");
+    printf("  list [-R] /<disk directory>\n");
+    printf("  get /<disk file> <local file>\n");
+    printf("  get -d <local directory> /<disk file or pattern> ...\n");
+    printf("  put [-s] <local file> /<disk file>\n");
+    printf("  fix [-r]\n");
+    printf("  defrag [-n]\n");
+    printf("  verify [-i]\n");
+    printf("  sync\n");
+    printf("  quit\n");
+    return -1;
+}
+
+void disktool(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 3)
+    {
+        printf("Expected: ./disktool <disk image> [command file]\n");
+        exit(1);
+    }
+
+    // Read commands from the given file, or from standard input when there is none
+    FILE *in = argc == 3 ? fopen(argv[2], "r") : stdin;
+    if (in == NULL)
+    {
+        perror("Error at in");
+        exit(1);
+    }
+
+    // Map the image once; every command shares the mapping and the indexes parsed from it
+    struct disk_t disk;
+    if (disk_open(&disk, argv[1], true) == -1)
+        exit(1);
+
+    bool interactive = in == stdin && isatty(STDIN_FILENO);
+    bool failed = false;
+    char *line = NULL;
+    size_t capacity = 0;
+    while (true)
+    {
+        if (interactive == true)
+        {
+            printf("disktool> ");
+            fflush(stdout);
+        }
+        if (getline(&line, &capacity, in) == -1)
+            break;
+        if (strncmp(line, "quit", 4) == 0 && strchr(" \t\r\n", line[4]) != NULL)
+            break;
+        if (disktool_command(&disk, line) == -1)
+            failed = true;
+    }
+
+    free(line);
+    disk_close(&disk);
+    if (in != stdin)
+        fclose(in);
+    if (failed == true)
+        exit(1);
 }
 
 int main(int argc, char *argv[])
@@ -483,8 +4362,18 @@ int main(int argc, char *argv[])
     diskput(argc, argv);
 #elif defined(PART5)
     diskfix(argc, argv);
+#elif defined(PART6)
+    disktool(argc, argv);
+#elif defined(PART7)
+    diskmkfs(argc, argv);
+#elif defined(PART8)
+    diskbench(argc, argv);
+#elif defined(PART9)
+    diskdefrag(argc, argv);
+#elif defined(PART10)
+    diskverify(argc, argv);
 #else
-#error "PART[12345] must be defined"
+#error "One of PART1 to PART10 must be defined"
 #endif
     return 0;
-}
\ No newline at end of file
+}
\ No newline at end of file